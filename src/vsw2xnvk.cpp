@@ -23,8 +23,28 @@
   SOFTWARE.
 */
 
+#include <cstdlib>
 #include <fstream>
+#include <list>
+#include <map>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <future>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 #include "gpu.h"
 #include "waifu2x.hpp"
 #include "VSHelper.h"
@@ -43,27 +63,545 @@ static int tryCreateGpuInstance() {
 
 static void tryDestoryGpuInstance() {
     ncnn::MutexLockGuard lg(instanceLock);
+    // nets and shaders shared between instances go with the last Waifu2x, which is deleted before this
     if (--instanceCounter == 0) {
         ncnn::destroy_gpu_instance();
     }
 }
 
+// upper bounds of the frame time histogram in ms, the last bucket takes everything slower
+static const int latencyBuckets[] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+static const int numLatencyBuckets = sizeof(latencyBuckets) / sizeof(latencyBuckets[0]) + 1;
+
+struct Counters {
+    int64_t frames = 0;
+    int64_t errors = 0;
+    double wallMs = 0;
+    double waitMs = 0;
+    double processMs = 0;
+    int64_t tiles = 0;
+    int64_t bytesUploaded = 0;
+    int64_t bytesDownloaded = 0;
+    int64_t latency[numLatencyBuckets] = {};
+
+    void add(const Counters &other) {
+        frames += other.frames;
+        errors += other.errors;
+        wallMs += other.wallMs;
+        waitMs += other.waitMs;
+        processMs += other.processMs;
+        tiles += other.tiles;
+        bytesUploaded += other.bytesUploaded;
+        bytesDownloaded += other.bytesDownloaded;
+        for (int i = 0; i < numLatencyBuckets; i++)
+            latency[i] += other.latency[i];
+    }
+};
+
+// admits process() calls on a device for every filter instance in the process, first come first
+// served, while a compute queue is free and the estimated VRAM of the calls already running leaves
+// room. Instances also reserve what they keep allocated, so tile sizes picked later leave room for it.
+class DeviceArbiter {
+public:
+    void reserve(int gpuId, double mb) {
+        std::lock_guard<std::mutex> guard(mtx);
+        device(gpuId).reservedMb += mb;
+    }
+
+    void unreserve(int gpuId, double mb) {
+        std::lock_guard<std::mutex> guard(mtx);
+        device(gpuId).reservedMb -= mb;
+    }
+
+    double reserved(int gpuId) {
+        std::lock_guard<std::mutex> guard(mtx);
+        return device(gpuId).reservedMb;
+    }
+
+    // a call larger than the budget still runs, alone
+    void admit(int gpuId, double mb) {
+        std::unique_lock<std::mutex> lock(mtx);
+        Device &dev = device(gpuId);
+        const uint64_t ticket = dev.nextTicket++;
+        cv.wait(lock, [&] {
+            return ticket == dev.serving && dev.running < dev.queues && (dev.running == 0 || dev.runningMb + mb <= dev.budgetMb);
+        });
+        dev.serving++;
+        dev.running++;
+        dev.runningMb += mb;
+        cv.notify_all();
+    }
+
+    void release(int gpuId, double mb) {
+        std::lock_guard<std::mutex> guard(mtx);
+        Device &dev = device(gpuId);
+        dev.running--;
+        dev.runningMb -= mb;
+        cv.notify_all();
+    }
+
+private:
+    struct Device {
+        int queues;
+        double budgetMb;
+        int running;
+        double runningMb;
+        double reservedMb;
+        uint64_t nextTicket;
+        uint64_t serving;
+    };
+
+    Device &device(int gpuId) {
+        std::map<int, Device>::iterator it = devices.find(gpuId);
+        if (it == devices.end()) {
+            const Device dev{ int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()),
+                              static_cast<double>(ncnn::get_gpu_device(gpuId)->get_heap_budget()), 0, 0.0, 0.0, 0, 0 };
+            it = devices.emplace(gpuId, dev).first;
+        }
+        return it->second;
+    }
+
+    std::map<int, Device> devices;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+static DeviceArbiter deviceArbiter;
+
+// hands every frame to the engine that has a free slot and, among those, the best
+// measured time per frame, so that devices of different speed are all kept busy
+class Scheduler {
+public:
+    // vramMb is the estimate for one process() call on a gpu, reserved on the device for every slot
+    void add(Waifu2x *waifu2x, int gpuId, int slots, double vramMb) {
+        engines.push_back(Engine{ waifu2x, gpuId, slots, vramMb, 0, 0.0, Counters() });
+        if (gpuId >= 0)
+            deviceArbiter.reserve(gpuId, vramMb * slots);
+    }
+
+    ~Scheduler() {
+        for (Engine& e : engines) {
+            delete e.waifu2x;
+            if (e.gpuId >= 0)
+                deviceArbiter.unreserve(e.gpuId, e.vramMb * e.slots);
+        }
+    }
+
+    int acquire() {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (;;) {
+            int best = -1;
+            for (int i = 0; i < static_cast<int>(engines.size()); i++) {
+                const Engine& e = engines[i];
+                if (e.busy >= e.slots)
+                    continue;
+                // engines without a measurement yet are tried first
+                if (best < 0 || e.msPerFrame < engines[best].msPerFrame)
+                    best = i;
+            }
+            if (best >= 0) {
+                engines[best].busy++;
+                return best;
+            }
+            cv.wait(lock);
+        }
+    }
+
+    void release(int i, double ms) {
+        std::lock_guard<std::mutex> guard(mtx);
+        Engine& e = engines[i];
+        e.busy--;
+        if (ms > 0)
+            e.msPerFrame = e.msPerFrame > 0 ? e.msPerFrame * 0.9 + ms * 0.1 : ms;
+        cv.notify_one();
+    }
+
+    void record(int i, const Counters &frame) {
+        std::lock_guard<std::mutex> guard(mtx);
+        engines[i].counters.add(frame);
+    }
+
+    // device and counters of every engine
+    std::vector<std::pair<int, Counters>> counters() {
+        std::lock_guard<std::mutex> guard(mtx);
+        std::vector<std::pair<int, Counters>> result;
+        for (const Engine& e : engines)
+            result.emplace_back(e.gpuId, e.counters);
+        return result;
+    }
+
+    Waifu2x *engine(int i) const {
+        return engines[i].waifu2x;
+    }
+
+    int gpuId(int i) const {
+        return engines[i].gpuId;
+    }
+
+    double vramMb(int i) const {
+        return engines[i].vramMb;
+    }
+
+private:
+    struct Engine {
+        Waifu2x *waifu2x;
+        int gpuId;
+        int slots;
+        double vramMb;
+        int busy;
+        double msPerFrame;
+        Counters counters;
+    };
+
+    std::vector<Engine> engines;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// Waifu2x sample format of frames in fi, -1 for a format it doesn't take
+static int sampleFormat(const VSFormat *fi) {
+    if (fi->sampleType == stFloat && fi->bitsPerSample == 32)
+        return Waifu2x::FORMAT_FP32;
+    if (fi->sampleType == stFloat && fi->bitsPerSample == 16)
+        return Waifu2x::FORMAT_FP16;
+    if (fi->sampleType == stInteger && fi->bitsPerSample == 8)
+        return Waifu2x::FORMAT_U8;
+    if (fi->sampleType == stInteger && fi->bitsPerSample <= 16)
+        return Waifu2x::FORMAT_U16;
+    return -1;
+}
+
+// summary of a source frame: a hash of every sample for exact matches, and the mean of each
+// cell of a fingerprintGrid x fingerprintGrid grid per plane for near matches. The roi_mask
+// frame, if any, is hashed on its own and always has to match exactly.
+static const int fingerprintGrid = 32;
+
+struct Fingerprint {
+    uint64_t hash;
+    uint64_t mask;
+    std::vector<float> cells;
+};
+
+static Fingerprint fingerprint(const VSFrameRef *frame, const VSFrameRef *mask, const VSAPI *vsapi) {
+    const VSFormat *fi = vsapi->getFrameFormat(frame);
+    const int width = vsapi->getFrameWidth(frame, 0);
+    const int height = vsapi->getFrameHeight(frame, 0);
+    const int bytes = fi->bytesPerSample;
+    const int format = sampleFormat(fi);
+
+    Fingerprint fp;
+    fp.hash = Waifu2x::HASH_SEED;
+    fp.mask = Waifu2x::HASH_SEED;
+    if (mask) {
+        // only the first plane of the mask is read, as in activeRegion()
+        const uint8_t *p = vsapi->getReadPtr(mask, 0);
+        const int stride = vsapi->getStride(mask, 0);
+        const size_t rowSize = static_cast<size_t>(vsapi->getFrameWidth(mask, 0)) * vsapi->getFrameFormat(mask)->bytesPerSample;
+        for (int y = 0; y < vsapi->getFrameHeight(mask, 0); y++, p += stride)
+            fp.mask = Waifu2x::hash_bytes(p, rowSize, fp.mask);
+    }
+    fp.cells.assign(RGB_CHANNELS * fingerprintGrid * fingerprintGrid, 0.f);
+    for (int plane = 0; plane < RGB_CHANNELS; plane++) {
+        const uint8_t *p = vsapi->getReadPtr(frame, plane);
+        const int stride = vsapi->getStride(frame, plane);
+        for (int y = 0; y < height; y++, p += stride) {
+            fp.hash = Waifu2x::hash_bytes(p, static_cast<size_t>(width) * bytes, fp.hash);
+            float *cells = fp.cells.data() + (plane * fingerprintGrid + static_cast<int64_t>(y) * fingerprintGrid / height) * fingerprintGrid;
+            for (int x = 0; x < width; x++)
+                cells[static_cast<int64_t>(x) * fingerprintGrid / width] += Waifu2x::load_sample(p, x, format, fi->bitsPerSample);
+        }
+    }
+
+    // every cell covers about the same area, the sums become mean values
+    for (int plane = 0; plane < RGB_CHANNELS; plane++) {
+        for (int cy = 0; cy < fingerprintGrid; cy++) {
+            const int rows = static_cast<int>(static_cast<int64_t>(cy + 1) * height / fingerprintGrid - static_cast<int64_t>(cy) * height / fingerprintGrid);
+            for (int cx = 0; cx < fingerprintGrid; cx++) {
+                const int cols = static_cast<int>(static_cast<int64_t>(cx + 1) * width / fingerprintGrid - static_cast<int64_t>(cx) * width / fingerprintGrid);
+                float &cell = fp.cells[(plane * fingerprintGrid + cy) * fingerprintGrid + cx];
+                // cells are empty when the frame is smaller than the grid
+                if (rows > 0 && cols > 0)
+                    cell /= static_cast<float>(rows) * cols;
+            }
+        }
+    }
+    return fp;
+}
+
+// outputs of recently processed frames, so duplicates of them are returned without processing.
+// Holds at most capacity frame references, least recently used go first.
+class FrameCache {
+public:
+    FrameCache(int capacity, double threshold, const VSAPI *vsapi) : capacity(capacity), threshold(threshold), vsapi(vsapi) {
+    }
+
+    ~FrameCache() {
+        for (const Entry &e : entries)
+            vsapi->freeFrame(e.frame);
+    }
+
+    // returns a new reference to the cached output and the number of the frame it was made for
+    const VSFrameRef *find(const Fingerprint &fp, int &n) {
+        std::lock_guard<std::mutex> guard(mtx);
+        checks++;
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (!matches(fp, it->fp))
+                continue;
+            entries.splice(entries.begin(), entries, it);
+            hits++;
+            n = it->n;
+            return vsapi->cloneFrameRef(it->frame);
+        }
+        return nullptr;
+    }
+
+    // takes over the frame reference
+    void insert(Fingerprint fp, int n, const VSFrameRef *frame) {
+        std::lock_guard<std::mutex> guard(mtx);
+        entries.push_front(Entry{ std::move(fp), n, frame });
+        if (static_cast<int>(entries.size()) > capacity) {
+            vsapi->freeFrame(entries.back().frame);
+            entries.pop_back();
+        }
+    }
+
+    void counts(int64_t &checked, int64_t &reused) {
+        std::lock_guard<std::mutex> guard(mtx);
+        checked = checks;
+        reused = hits;
+    }
+
+private:
+    struct Entry {
+        Fingerprint fp;
+        int n;
+        const VSFrameRef *frame;
+    };
+
+    bool matches(const Fingerprint &a, const Fingerprint &b) const {
+        if (a.mask != b.mask)
+            return false;
+        if (a.hash == b.hash)
+            return true;
+        if (threshold <= 0)
+            return false;
+        for (size_t i = 0; i < a.cells.size(); i++) {
+            if (std::fabs(a.cells[i] - b.cells[i]) > threshold)
+                return false;
+        }
+        return true;
+    }
+
+    int capacity;
+    double threshold;
+    const VSAPI *vsapi;
+    std::list<Entry> entries;
+    int64_t checks = 0;
+    int64_t hits = 0;
+    std::mutex mtx;
+};
+
+// bounding box of the samples above threshold, in 0-1, in any of the first planes of frame,
+// empty when there are none
+static Waifu2x::Region activeRegion(const VSFrameRef *frame, int planes, float threshold, const VSAPI *vsapi) {
+    const VSFormat *fi = vsapi->getFrameFormat(frame);
+    const int format = sampleFormat(fi);
+    const int width = vsapi->getFrameWidth(frame, 0);
+    const int height = vsapi->getFrameHeight(frame, 0);
+
+    Waifu2x::Region region{ width, height, 0, 0 };
+    for (int plane = 0; plane < planes; plane++) {
+        const uint8_t *p = vsapi->getReadPtr(frame, plane);
+        const int stride = vsapi->getStride(frame, plane);
+        for (int y = 0; y < height; y++, p += stride) {
+            for (int x = 0; x < width; x++) {
+                if (Waifu2x::load_sample(p, x, format, fi->bitsPerSample) <= threshold)
+                    continue;
+                region.x0 = std::min(region.x0, x);
+                region.y0 = std::min(region.y0, y);
+                region.x1 = std::max(region.x1, x + 1);
+                region.y1 = std::max(region.y1, y + 1);
+            }
+        }
+    }
+    return region;
+}
+
+// samples within 2% of black don't count as picture content for roi_auto, only luma is looked at for YUV
+static Waifu2x::Region autoRegion(const VSFrameRef *frame, const VSAPI *vsapi) {
+    const VSFormat *fi = vsapi->getFrameFormat(frame);
+    float black = 0.f, range = 1.f;
+    if (fi->sampleType == stInteger && fi->colorFamily == cmYUV) {
+        const float peak = static_cast<float>((1 << fi->bitsPerSample) - 1);
+        black = (16 << (fi->bitsPerSample - 8)) / peak;
+        range = (219 << (fi->bitsPerSample - 8)) / peak;
+    }
+    return activeRegion(frame, fi->colorFamily == cmYUV ? 1 : RGB_CHANNELS, black + range * 0.02f, vsapi);
+}
+
+// how the region of interest of a frame is found, tiles outside of it are only resized
+enum RoiMode {
+    ROI_NONE,
+    ROI_RECT,
+    ROI_AUTO,
+    ROI_MASK
+};
+
+// frames started ahead of the one VapourSynth asked for, run by window worker threads owned by
+// the filter. Every frame is claimed once, either when it is started ahead or when it is taken,
+// so none runs twice.
+class Prefetcher {
+public:
+    typedef std::pair<const VSFrameRef *, std::string> Result;
+
+    Prefetcher(int window, const VSAPI *vsapi) : window(window), vsapi(vsapi), stopping(false) {
+        for (int i = 0; i < window; i++)
+            workers.emplace_back(&Prefetcher::run, this);
+    }
+
+    // frames already started still run, they hold source frame references
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> guard(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread &t : workers)
+            t.join();
+        for (std::pair<const int, std::future<Result>> &e : started)
+            vsapi->freeFrame(e.second.get().first);
+    }
+
+    // runs work for n unless n is already started or requested, returns whether it did. Under the
+    // lock, so that take() either finds the frame or has claimed it first.
+    template <typename F>
+    bool start(int n, F &&work) {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (!claimed.insert(n).second)
+            return false;
+        std::packaged_task<Result()> task(std::forward<F>(work));
+        started.emplace(n, task.get_future());
+        queue.push_back(std::move(task));
+        cv.notify_one();
+        return true;
+    }
+
+    // the frame started ahead, or an invalid future when there is none
+    std::future<Result> take(int n) {
+        std::lock_guard<std::mutex> guard(mtx);
+        claimed.insert(n);
+        std::future<Result> future;
+        std::map<int, std::future<Result>>::iterator it = started.find(n);
+        if (it != started.end()) {
+            future = std::move(it->second);
+            started.erase(it);
+        }
+        return future;
+    }
+
+    // done with n. Frames started ahead but never asked for, after a seek, are dropped once
+    // they fall out of the window behind n.
+    void finish(int n) {
+        std::vector<std::future<Result>> stale;
+        {
+            std::lock_guard<std::mutex> guard(mtx);
+            claimed.erase(claimed.begin(), claimed.lower_bound(n - window * 2));
+            std::map<int, std::future<Result>>::iterator end = started.lower_bound(n - window * 2);
+            for (std::map<int, std::future<Result>>::iterator it = started.begin(); it != end; ++it)
+                stale.push_back(std::move(it->second));
+            started.erase(started.begin(), end);
+        }
+        for (std::future<Result> &future : stale)
+            vsapi->freeFrame(future.get().first);
+    }
+
+private:
+    // frames run in the order they were started, the queue is emptied before the workers stop
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (;;) {
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            std::packaged_task<Result()> task = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    int window;
+    const VSAPI *vsapi;
+    std::set<int> claimed;
+    std::map<int, std::future<Result>> started;
+    std::deque<std::packaged_task<Result()>> queue;
+    std::vector<std::thread> workers;
+    bool stopping;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
 typedef struct {
     VSNodeRef *node;
+    VSNodeRef *mask;
     VSVideoInfo vi;
-    Waifu2x *waifu2x;
+    Scheduler *scheduler;
+    FrameCache *dedup;
+    Prefetcher *prefetch;
+    int lookahead;
+    int id;
+    bool stats;
+    RoiMode roiMode;
+    Waifu2x::Region roi;
 } FilterData;
 
-static int filter(const VSFrameRef *src, VSFrameRef *dst, FilterData * const VS_RESTRICT d, const VSAPI *vsapi) noexcept {
-    const int srcStride = vsapi->getStride(src, 0) / static_cast<int>(sizeof(float));
-    const int dstStride = vsapi->getStride(dst, 0) / static_cast<int>(sizeof(float));
-    auto *             srcR = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 0));
-    auto *             srcG = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 1));
-    auto *             srcB = reinterpret_cast<const float *>(vsapi->getReadPtr(src, 2));
-    auto * VS_RESTRICT dstR = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 0));
-    auto * VS_RESTRICT dstG = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 1));
-    auto * VS_RESTRICT dstB = reinterpret_cast<float *>(vsapi->getWritePtr(dst, 2));
-    return d->waifu2x->process(srcR, srcG, srcB, dstR, dstG, dstB, srcStride, dstStride);
+// live instances reported by Stats()
+static std::mutex statsLock;
+static std::vector<FilterData *> statsInstances;
+static int statsNextId = 0;
+
+static int filter(const VSFrameRef *src, VSFrameRef *dst, const Waifu2x::Region *region, FilterData * const VS_RESTRICT d,
+                  const VSAPI *vsapi, int &engine, double &waitMs, double &processMs, Waifu2x::Work &work) noexcept {
+    const int srcStride = vsapi->getStride(src, 0);
+    const int dstStride = vsapi->getStride(dst, 0);
+    const uint8_t *srcp[RGB_CHANNELS];
+    uint8_t *dstp[RGB_CHANNELS];
+    for (int plane = 0; plane < RGB_CHANNELS; plane++) {
+        srcp[plane] = vsapi->getReadPtr(src, plane);
+        dstp[plane] = vsapi->getWritePtr(dst, plane);
+    }
+
+    const auto queued = std::chrono::steady_clock::now();
+    engine = d->scheduler->acquire();
+    const int gpuId = d->scheduler->gpuId(engine);
+    if (gpuId >= 0)
+        deviceArbiter.admit(gpuId, d->scheduler->vramMb(engine));
+    const auto start = std::chrono::steady_clock::now();
+    const int err = d->scheduler->engine(engine)->process(srcp, dstp, srcStride, dstStride, nullptr, region, &work);
+    const auto end = std::chrono::steady_clock::now();
+    if (gpuId >= 0)
+        deviceArbiter.release(gpuId, d->scheduler->vramMb(engine));
+    waitMs = std::chrono::duration<double, std::milli>(start - queued).count();
+    processMs = std::chrono::duration<double, std::milli>(end - start).count();
+    d->scheduler->release(engine, err == Waifu2x::ERROR_OK ? processMs : 0.0);
+    return err;
+}
+
+static std::string errorMessage(int err, int gpuId) {
+    const std::string device = gpuId < 0 ? "cpu" : "gpu " + std::to_string(gpuId);
+    switch (err) {
+        case Waifu2x::ERROR_EXTRACTOR:
+            return "inference failed on " + device + ", likely out of memory. Try to decrease tile_size or gpu_thread";
+        case Waifu2x::ERROR_UPLOAD:
+            return "upload to " + device + " failed. Try to decrease gpu_thread";
+        case Waifu2x::ERROR_SUBMIT:
+            return "queue submit on " + device + " failed. Try to decrease gpu_thread";
+        case Waifu2x::ERROR_DOWNLOAD:
+            return "download from " + device + " failed. Try to decrease gpu_thread";
+        default:
+            return "unknown error " + std::to_string(err) + " on " + device;
+    }
 }
 
 static void VS_CC filterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
@@ -71,33 +609,129 @@ static void VS_CC filterInit(VSMap *in, VSMap *out, void **instanceData, VSNode
     vsapi->setVideoInfo(&d->vi, 1, node);
 }
 
+// output of frame n, or nullptr and a message in error. Takes over src and mask, which may be nullptr.
+static const VSFrameRef *processFrame(int n, const VSFrameRef *src, const VSFrameRef *mask, FilterData *d, VSCore *core,
+                                      const VSAPI *vsapi, std::string &error) {
+    const auto start = std::chrono::steady_clock::now();
+    auto dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
+
+    Fingerprint fp;
+    if (d->dedup) {
+        fp = fingerprint(src, mask, vsapi);
+        int reusedFrom;
+        const VSFrameRef *cached = d->dedup->find(fp, reusedFrom);
+        if (cached) {
+            for (int plane = 0; plane < RGB_CHANNELS; plane++) {
+                vs_bitblt(vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane),
+                          vsapi->getReadPtr(cached, plane), vsapi->getStride(cached, plane),
+                          static_cast<size_t>(d->vi.width) * d->vi.format->bytesPerSample, d->vi.height);
+            }
+            vsapi->propSetInt(vsapi->getFramePropsRW(dst), "W2XNVK_ReusedFrom", reusedFrom, paReplace);
+            vsapi->freeFrame(cached);
+            vsapi->freeFrame(src);
+            vsapi->freeFrame(mask);
+            return dst;
+        }
+    }
+
+    Waifu2x::Region roi = d->roi;
+    if (d->roiMode == ROI_AUTO)
+        roi = autoRegion(src, vsapi);
+    else if (d->roiMode == ROI_MASK)
+        roi = activeRegion(mask, 1, 0.f, vsapi);
+    vsapi->freeFrame(mask);
+
+    int engine;
+    double waitMs, processMs;
+    Waifu2x::Work work;
+    int err = filter(src, dst, d->roiMode == ROI_NONE ? nullptr : &roi, d, vsapi, engine, waitMs, processMs, work);
+    const std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - start;
+
+    Counters frame;
+    frame.frames = err == Waifu2x::ERROR_OK;
+    frame.errors = err != Waifu2x::ERROR_OK;
+    frame.wallMs = wall.count();
+    frame.waitMs = waitMs;
+    frame.processMs = processMs;
+    frame.tiles = work.tiles;
+    frame.bytesUploaded = work.bytes_uploaded;
+    frame.bytesDownloaded = work.bytes_downloaded;
+    const int bucket = static_cast<int>(std::upper_bound(latencyBuckets, latencyBuckets + numLatencyBuckets - 1, static_cast<int>(wall.count())) - latencyBuckets);
+    frame.latency[bucket] = 1;
+    d->scheduler->record(engine, frame);
+
+    if (err == Waifu2x::ERROR_OK) {
+        if (d->stats) {
+            VSMap *props = vsapi->getFramePropsRW(dst);
+            vsapi->propSetFloat(props, "W2XNVK_WallTime", frame.wallMs, paReplace);
+            vsapi->propSetFloat(props, "W2XNVK_WaitTime", frame.waitMs, paReplace);
+            vsapi->propSetFloat(props, "W2XNVK_WallProcessTime", frame.processMs, paReplace);
+            vsapi->propSetInt(props, "W2XNVK_Tiles", frame.tiles, paReplace);
+            vsapi->propSetInt(props, "W2XNVK_BytesUploaded", frame.bytesUploaded, paReplace);
+            vsapi->propSetInt(props, "W2XNVK_BytesDownloaded", frame.bytesDownloaded, paReplace);
+            vsapi->propSetInt(props, "W2XNVK_Device", d->scheduler->gpuId(engine), paReplace);
+        }
+        if (d->dedup)
+            d->dedup->insert(std::move(fp), n, vsapi->cloneFrameRef(dst));
+        vsapi->freeFrame(src);
+        return dst;
+    }
+
+    error = "Waifu2x-NCNN-Vulkan: " + errorMessage(err, d->scheduler->gpuId(engine));
+    vsapi->freeFrame(src);
+    vsapi->freeFrame(dst);
+    return nullptr;
+}
+
 static const VSFrameRef *VS_CC filterGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     auto *d = static_cast<FilterData *>(*instanceData);
 
+    // with lookahead, the next frames are requested along with n and started on threads of the
+    // filter, so the worker asking for n is the only VapourSynth thread that waits on the device
+    const int last = d->vi.numFrames > 0 ? std::min(n + d->lookahead, d->vi.numFrames - 1) : n;
+
     if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
+        for (int i = n; i <= last; i++) {
+            vsapi->requestFrameFilter(i, d->node, frameCtx);
+            if (d->mask)
+                vsapi->requestFrameFilter(i, d->mask, frameCtx);
+        }
     } else if (activationReason == arAllFramesReady) {
-        auto src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        auto dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
-
-        int err = filter(src, dst, d, vsapi);
-        switch (err) {
-            case Waifu2x::ERROR_OK:
-                vsapi->freeFrame(src);
-                return dst;
-            case Waifu2x::ERROR_EXTRACTOR:
-                vsapi->setFilterError("Waifu2x-NCNN-Vulkan: Waifu2x extractor error. Try to decrease tile_size or gpu_thread", frameCtx);
+        for (int i = n + 1; i <= last && d->prefetch; i++) {
+            const VSFrameRef *src = vsapi->getFrameFilter(i, d->node, frameCtx);
+            const VSFrameRef *mask = d->mask ? vsapi->getFrameFilter(i, d->mask, frameCtx) : nullptr;
+            const bool started = d->prefetch->start(i, [=] {
+                Prefetcher::Result result;
+                result.first = processFrame(i, src, mask, d, core, vsapi, result.second);
+                return result;
+            });
+            if (!started) {
                 vsapi->freeFrame(src);
-                vsapi->freeFrame(dst);
-                return nullptr;
-            case Waifu2x::ERROR_DOWNLOAD:
-            case Waifu2x::ERROR_UPLOAD:
-            case Waifu2x::ERROR_SUBMIT:
-                vsapi->setFilterError("Waifu2x-NCNN-Vulkan: Waifu2x submit error. Try to decrease gpu_thread", frameCtx);
-                vsapi->freeFrame(src);
-                vsapi->freeFrame(dst);
-                return nullptr;
+                vsapi->freeFrame(mask);
+            }
         }
+
+        std::future<Prefetcher::Result> ahead;
+        if (d->prefetch)
+            ahead = d->prefetch->take(n);
+
+        std::string error;
+        const VSFrameRef *dst;
+        if (ahead.valid()) {
+            Prefetcher::Result result = ahead.get();
+            dst = result.first;
+            error = result.second;
+        } else {
+            const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+            const VSFrameRef *mask = d->mask ? vsapi->getFrameFilter(n, d->mask, frameCtx) : nullptr;
+            dst = processFrame(n, src, mask, d, core, vsapi, error);
+        }
+        if (d->prefetch)
+            d->prefetch->finish(n);
+
+        if (!dst)
+            vsapi->setFilterError(error.c_str(), frameCtx);
+        return dst;
     }
 
     return nullptr;
@@ -105,40 +739,409 @@ static const VSFrameRef *VS_CC filterGetFrame(int n, int activationReason, void
 
 static void VS_CC filterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     auto *d = static_cast<FilterData *>(instanceData);
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        statsInstances.erase(std::find(statsInstances.begin(), statsInstances.end(), d));
+    }
+    // stops the lookahead workers, frames still running ahead use everything below
+    delete d->prefetch;
     vsapi->freeNode(d->node);
-    delete d->waifu2x;
+    vsapi->freeNode(d->mask);
+    delete d->dedup;
+    delete d->scheduler;
     delete d;
     tryDestoryGpuInstance();
 }
 
+static void appendCounters(VSMap *out, const std::string &prefix, const Counters &c, const VSAPI *vsapi) {
+    vsapi->propSetInt(out, (prefix + "frames").c_str(), c.frames, paAppend);
+    vsapi->propSetInt(out, (prefix + "errors").c_str(), c.errors, paAppend);
+    vsapi->propSetFloat(out, (prefix + "wall_ms").c_str(), c.wallMs, paAppend);
+    vsapi->propSetFloat(out, (prefix + "wait_ms").c_str(), c.waitMs, paAppend);
+    vsapi->propSetFloat(out, (prefix + "wall_process_ms").c_str(), c.processMs, paAppend);
+    vsapi->propSetInt(out, (prefix + "tiles").c_str(), c.tiles, paAppend);
+    vsapi->propSetInt(out, (prefix + "bytes_uploaded").c_str(), c.bytesUploaded, paAppend);
+    vsapi->propSetInt(out, (prefix + "bytes_downloaded").c_str(), c.bytesDownloaded, paAppend);
+    for (int i = 0; i < numLatencyBuckets; i++)
+        vsapi->propSetInt(out, (prefix + "latency_hist").c_str(), c.latency[i], paAppend);
+}
+
+// cumulative counters of every live instance and every device, one array element per
+// instance or device. Histograms are flattened, latency_buckets_ms entries per instance or device.
+static void VS_CC statsCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::lock_guard<std::mutex> guard(statsLock);
+    std::map<int, Counters> devices;
+    for (FilterData *d : statsInstances) {
+        Counters total;
+        for (const std::pair<int, Counters> &e : d->scheduler->counters()) {
+            total.add(e.second);
+            devices[e.first].add(e.second);
+        }
+        vsapi->propSetInt(out, "instance_id", d->id, paAppend);
+        int64_t checked = 0, reused = 0;
+        if (d->dedup)
+            d->dedup->counts(checked, reused);
+        vsapi->propSetInt(out, "instance_dedup_checked", checked, paAppend);
+        vsapi->propSetInt(out, "instance_dedup_reused", reused, paAppend);
+        appendCounters(out, "instance_", total, vsapi);
+    }
+    for (const std::pair<const int, Counters> &device : devices) {
+        vsapi->propSetInt(out, "device_id", device.first, paAppend);
+        appendCounters(out, "device_", device.second, vsapi);
+    }
+    for (int bound : latencyBuckets)
+        vsapi->propSetInt(out, "latency_buckets_ms", bound, paAppend);
+}
+
+// vram available to a single tile, in MByte, after what other instances on the device keep.
+// Every gpu thread has pipelineDepth rows or tiles in flight, and batched tta runs tta / 2
+// orientations side by side, as in passVramEstimate.
+static double tileVramBudget(int gpuId, int precision, int model, int gpuThread, int pipelineDepth, int tta, int batch) {
+    double vram = std::max(ncnn::get_gpu_device(gpuId)->get_heap_budget() - deviceArbiter.reserved(gpuId), 0.0); // in MByte
+    double factor = (precision == 32 ? 2 : 1) * (model == 2 ? 1.5 : 1) * gpuThread * pipelineDepth * (batch && tta > 1 ? tta / 2 : 1);
+    return vram / factor;
+}
+
+static int autoTileSize(int gpuId, int precision, int model, int gpuThread, int pipelineDepth, int tta, int batch) {
+    double budget = tileVramBudget(gpuId, precision, model, gpuThread, pipelineDepth, tta, batch);
+    if (budget > 900)
+        return 360;
+    else if (budget > 450)
+        return 240;
+    else
+        return 180;
+}
+
+// vram one process() call of a pass takes, in MByte, by the same rule as tileVramBudget: 900 MB
+// for a 360x360 fp16 upconv_7 tile, for every tile row in flight. Batched tta runs half of the
+// orientations side by side, and a pass followed by another keeps its output frame as float RGB.
+static double passVramEstimate(int tileW, int tileH, int precision, int model, int pipelineDepth, int tta, int batch,
+                               int outWidth, int outHeight, bool chained) {
+    double mb = 900.0 * tileW * tileH / (360 * 360) * (precision == 32 ? 2 : 1) * (model == 2 ? 1.5 : 1) * pipelineDepth;
+    if (batch && tta > 1)
+        mb *= tta / 2;
+    if (chained)
+        mb += static_cast<double>(outWidth) * outHeight * RGB_CHANNELS * sizeof(float) / (1 << 20);
+    return mb;
+}
+
+static int divCeil(int a, int b) {
+    return (a + b - 1) / b;
+}
+
+// the tuning cache file name in W2XNVK_CACHE_DIR, else next to the plugin when that can be written to,
+// else in the user's cache directory
+static std::string cacheFilePath(const std::string &pluginDir, const char *name) {
+    const char *cacheDir = getenv("W2XNVK_CACHE_DIR");
+    if (cacheDir && *cacheDir)
+        return std::string{ cacheDir } + '/' + name;
+
+    const std::string pluginFile = pluginDir + '/' + name;
+    if (std::ofstream(pluginFile, std::ios::app))
+        return pluginFile;
+
+    std::string userDir;
+#ifdef _WIN32
+    const char *localAppData = getenv("LOCALAPPDATA");
+    if (localAppData && *localAppData)
+        userDir = std::string{ localAppData } + "/w2xnvk";
+#else
+    const char *xdgCache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdgCache && *xdgCache) {
+        userDir = std::string{ xdgCache } + "/w2xnvk";
+    } else if (home && *home) {
+        mkdir((std::string{ home } + "/.cache").c_str(), 0755);
+        userDir = std::string{ home } + "/.cache/w2xnvk";
+    }
+#endif
+    if (userDir.empty())
+        return pluginFile;
+#ifdef _WIN32
+    _mkdir(userDir.c_str());
+#else
+    mkdir(userDir.c_str(), 0755);
+#endif
+    return userDir + '/' + name;
+}
+
+// a line that can't be written only costs the measurement again on the next run
+static void appendCacheLine(const std::string &cacheFile, const std::string &line, const VSAPI *vsapi) {
+    std::ofstream file(cacheFile, std::ios::app);
+    file << line << '\n';
+    file.close();
+    if (!file)
+        vsapi->logMessage(mtWarning, ("Waifu2x-NCNN-Vulkan: can't write " + cacheFile + ", the measurement will be repeated").c_str());
+}
+
+// runs a few tile shapes over a synthetic frame of the clip's size and returns the fastest.
+// Results are appended to cacheFile per device, driver, model and configuration, so that only
+// the first run of a configuration pays for the measurement.
+static std::pair<int, int> tuneTileSize(int gpuId, int gpuThread, const VSVideoInfo &vi, int scale, int model, int precision, int optProfile, int tta,
+                                        int batch, int prepadding, int pipelineDepth, bool stream, int format, int matrix,
+                                        const std::string &paramPath, const std::string &modelPath, const std::string &cacheFile,
+                                        const VSAPI *vsapi) {
+    const ncnn::GpuInfo &info = ncnn::get_gpu_info(gpuId);
+    std::ostringstream keyStream;
+    keyStream << info.device_name() << ' ' << info.vendor_id() << ':' << info.device_id() << ' ' << info.driver_version() << ' '
+              << modelPath.substr(modelPath.rfind("/models-") + 1) << ' ' << vi.width << 'x' << vi.height << ' '
+              << format << ' ' << precision << ' ' << optProfile << ' ' << tta << ' ' << batch << ' ' << gpuThread << ' ' << pipelineDepth << ' ' << stream;
+    const std::string key = keyStream.str();
+
+    std::ifstream cached(cacheFile);
+    std::string line;
+    while (std::getline(cached, line)) {
+        const size_t sep = line.rfind('\t');
+        if (sep != key.size() || line.compare(0, sep, key) != 0)
+            continue;
+        int w = 0, h = 0;
+        std::istringstream(line.substr(sep + 1)) >> w >> h;
+        if (w >= 32 && h >= 32 && w % 4 == 0 && h % 4 == 0)
+            return { w, h };
+    }
+
+    // the heuristic gives a 360 tile per 900 MB, larger tiles are allowed at the same memory per pixel
+    const int heuristic = autoTileSize(gpuId, precision, model, gpuThread, pipelineDepth, tta, batch);
+    const double budget = tileVramBudget(gpuId, precision, model, gpuThread, pipelineDepth, tta, batch);
+    const int maxSide = std::max(heuristic, static_cast<int>(360 * std::sqrt(budget / 900)));
+
+    std::vector<std::pair<int, int>> candidates;
+    for (int side : { heuristic, 128, 192, 256, 320, 384, 512 }) {
+        if (side > maxSide)
+            continue;
+        // equal tiles over the frame, rather than full tiles and a thin leftover at the edge
+        const int w = std::max(divCeil(divCeil(vi.width, divCeil(vi.width, side)), 4) * 4, 32);
+        const int h = std::max(divCeil(divCeil(vi.height, divCeil(vi.height, side)), 4) * 4, 32);
+        if (std::find(candidates.begin(), candidates.end(), std::make_pair(w, h)) == candidates.end())
+            candidates.emplace_back(w, h);
+    }
+
+    // sample values don't change the amount of work, a zeroed frame will do
+    const int bytes = vi.format->bytesPerSample;
+    const ptrdiff_t srcStride = static_cast<ptrdiff_t>(vi.width) * bytes;
+    const ptrdiff_t dstStride = srcStride * scale;
+    const size_t srcPlane = srcStride * vi.height;
+    const size_t dstPlane = dstStride * vi.height * scale;
+    std::vector<uint8_t> srcFrame(srcPlane * RGB_CHANNELS);
+    std::vector<std::vector<uint8_t>> dstFrames(gpuThread, std::vector<uint8_t>(dstPlane * RGB_CHANNELS));
+    const uint8_t *srcp[RGB_CHANNELS];
+    for (int plane = 0; plane < RGB_CHANNELS; plane++)
+        srcp[plane] = srcFrame.data() + srcPlane * plane;
+
+    std::pair<int, int> best{ heuristic, heuristic };
+    double bestMs = 0;
+    std::unique_ptr<Waifu2x> previous; // keeps the shared net loaded while the next candidate is created
+    for (const std::pair<int, int> &candidate : candidates) {
+        std::unique_ptr<Waifu2x> engine(new Waifu2x(vi.width, vi.height, scale, candidate.first, candidate.second, gpuId, gpuThread, 1,
+                                                    precision, optProfile, tta, batch, prepadding, pipelineDepth, stream, format,
+                                                    vi.format->bitsPerSample, matrix, 0, paramPath, modelPath));
+        previous.reset();
+
+        // gpu_thread frames at once like the filter would see them, the first round only warms up
+        double ms = 0;
+        bool ok = true;
+        for (int round = 0; round < 3 && ok; round++) {
+            std::atomic<int> failed{ 0 };
+            std::vector<std::thread> workers;
+            const auto start = std::chrono::steady_clock::now();
+            for (int t = 0; t < gpuThread; t++) {
+                workers.emplace_back([&, t] {
+                    uint8_t *dstp[RGB_CHANNELS];
+                    for (int plane = 0; plane < RGB_CHANNELS; plane++)
+                        dstp[plane] = dstFrames[t].data() + dstPlane * plane;
+                    if (engine->process(srcp, dstp, srcStride, dstStride) != Waifu2x::ERROR_OK)
+                        failed++;
+                });
+            }
+            for (std::thread &worker : workers)
+                worker.join();
+            const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            ok = failed == 0;
+            if (round == 1 || (round > 1 && elapsed.count() < ms))
+                ms = elapsed.count();
+        }
+
+        if (ok && (bestMs == 0 || ms < bestMs)) {
+            bestMs = ms;
+            best = candidate;
+        }
+        previous = std::move(engine);
+    }
+
+    if (bestMs > 0)
+        appendCacheLine(cacheFile, key + '\t' + std::to_string(best.first) + ' ' + std::to_string(best.second), vsapi);
+
+    return best;
+}
+
+// runs one tile of a textured frame with a few combinations of ncnn paths and returns the fastest whose
+// output stays within minPsnr of a precision 32 run with ncnn's defaults. Results are appended to
+// cacheFile per device, driver, model, precision and tile size, like tuneTileSize.
+static int tuneOptProfile(int gpuId, int tileW, int tileH, int scale, int precision, int prepadding,
+                          const std::string &paramPath, const std::string &modelPath, const std::string &cacheFile, const VSAPI *vsapi) {
+    const ncnn::GpuInfo &info = ncnn::get_gpu_info(gpuId);
+    std::ostringstream keyStream;
+    keyStream << info.device_name() << ' ' << info.vendor_id() << ':' << info.device_id() << ' ' << info.driver_version() << ' '
+              << modelPath.substr(modelPath.rfind("/models-") + 1) << ' ' << precision << ' ' << tileW << 'x' << tileH;
+    const std::string key = keyStream.str();
+
+    std::ifstream cached(cacheFile);
+    std::string line;
+    while (std::getline(cached, line)) {
+        const size_t sep = line.rfind('\t');
+        if (sep != key.size() || line.compare(0, sep, key) != 0)
+            continue;
+        int profile = -1;
+        std::istringstream(line.substr(sep + 1)) >> profile;
+        if (profile >= 0 && profile <= Waifu2x::OPT_ALL)
+            return profile;
+    }
+
+    // float RGB with edges and gradients, so that a broken path can't pass on flat input
+    const ptrdiff_t srcStride = static_cast<ptrdiff_t>(tileW) * sizeof(float);
+    const ptrdiff_t dstStride = srcStride * scale;
+    const size_t srcPlane = srcStride * tileH;
+    const size_t dstPlane = dstStride * tileH * scale;
+    std::vector<float> srcFrame(static_cast<size_t>(tileW) * tileH * RGB_CHANNELS);
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+        for (int y = 0; y < tileH; y++) {
+            for (int x = 0; x < tileW; x++)
+                srcFrame[(static_cast<size_t>(c) * tileH + y) * tileW + x] = ((x / 8 + y / 8 + c) % 2) * 0.5f + ((x * (c + 1) + y) % 64) / 128.f;
+        }
+    }
+    const uint8_t *srcp[RGB_CHANNELS];
+    for (int plane = 0; plane < RGB_CHANNELS; plane++)
+        srcp[plane] = reinterpret_cast<const uint8_t *>(srcFrame.data()) + srcPlane * plane;
+
+    auto run = [&](int profile, int runPrecision, std::vector<float> &dstFrame, int rounds) {
+        Waifu2x engine(tileW, tileH, scale, tileW, tileH, gpuId, 1, 1, runPrecision, profile, 1, 0, prepadding, 1, false,
+                       Waifu2x::FORMAT_FP32, 32, 0, 0, paramPath, modelPath);
+        uint8_t *dstp[RGB_CHANNELS];
+        for (int plane = 0; plane < RGB_CHANNELS; plane++)
+            dstp[plane] = reinterpret_cast<uint8_t *>(dstFrame.data()) + dstPlane * plane;
+        // the first round compiles pipelines and only warms up
+        double ms = 0;
+        for (int round = 0; round < rounds; round++) {
+            const auto start = std::chrono::steady_clock::now();
+            if (engine.process(srcp, dstp, srcStride, dstStride) != Waifu2x::ERROR_OK)
+                return -1.0;
+            const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            if (round == 1 || (round > 1 && elapsed.count() < ms))
+                ms = elapsed.count();
+        }
+        return ms;
+    };
+
+    const size_t samples = static_cast<size_t>(tileW) * tileH * scale * scale * RGB_CHANNELS;
+    std::vector<float> reference(samples), output(samples);
+    if (run(0, 32, reference, 1) < 0)
+        return 0;
+
+    const double minPsnr = 40.0;
+    int best = 0;
+    double bestMs = 0;
+    const int candidates[] = { 0, Waifu2x::OPT_FP16_ARITHMETIC, Waifu2x::OPT_PACK8, Waifu2x::OPT_FP16_ARITHMETIC | Waifu2x::OPT_PACK8,
+                               Waifu2x::OPT_NO_WINOGRAD, Waifu2x::OPT_FP16_ARITHMETIC | Waifu2x::OPT_NO_WINOGRAD,
+                               Waifu2x::OPT_NO_SGEMM, Waifu2x::OPT_FP16_ARITHMETIC | Waifu2x::OPT_NO_SGEMM };
+    for (int profile : candidates) {
+        if (precision != 16 && (profile & Waifu2x::OPT_FP16_ARITHMETIC))
+            continue;
+        const double ms = run(profile, precision, output, 3);
+        if (ms < 0)
+            continue;
+        double squared = 0;
+        for (size_t i = 0; i < samples; i++)
+            squared += (static_cast<double>(output[i]) - reference[i]) * (static_cast<double>(output[i]) - reference[i]);
+        const double mse = squared / samples;
+        if ((mse > 0 && 10 * std::log10(1 / mse) < minPsnr) || std::isnan(mse))
+            continue;
+        if (bestMs == 0 || ms < bestMs) {
+            bestMs = ms;
+            best = profile;
+        }
+    }
+
+    if (bestMs > 0)
+        appendCacheLine(cacheFile, key + '\t' + std::to_string(best), vsapi);
+
+    return best;
+}
+
+// one model run over the whole frame, chained passes keep the frame between them on the device
+struct Pass {
+    int model;
+    int noise;
+    int scale;
+    int prepadding;
+    std::string paramPath;
+    std::string modelPath;
+    std::vector<int> optProfiles; // per gpu_id
+};
+
 static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     FilterData d{};
     d.node = vsapi->propGetNode(in, "clip", 0, nullptr);
     d.vi = *vsapi->getVideoInfo(d.node);
 
-    int gpuId, noise, scale, model, tileSizeW, tileSizeH, gpuThread, precision, tta;
-    std::string paramPath, modelPath;
+    int noise, scale, model, precision, optProfile, tta, batch, pipelineDepth, format, matrix, cpuThread, tileCache, dedupFrames;
+    double dedupThreshold;
+    std::vector<int> gpuIds, gpuThreads, tileSizesW, tileSizesH;
+    std::vector<Pass> passes;
+    std::string tuneCacheFile, optProfileCacheFile;
+    int tw = 0, th = 0;
+    bool tuneTiles = false;
+    bool stream = false;
     char const * err_prompt = nullptr;
     do {
         int err;
 
-        err = tryCreateGpuInstance();
-        if (err) {
-            err_prompt = "create gpu instance failed";
+        // not fatal yet, the cpu can still be used on machines without a vulkan device
+        const bool gpuInstanceOk = tryCreateGpuInstance() == 0;
+
+        const VSFormat *fi = d.vi.format;
+        if (!isConstantFormat(&d.vi) || (fi->colorFamily != cmRGB && fi->colorFamily != cmYUV) ||
+            fi->subSamplingW != 0 || fi->subSamplingH != 0) {
+            err_prompt = "only constant RGB or YUV444 format supported";
             break;
         }
 
-        if (!isConstantFormat(&d.vi) || d.vi.format->colorFamily != cmRGB || d.vi.format->sampleType != stFloat || d.vi.format->bitsPerSample != 32) {
-            err_prompt = "only constant RGB format and 32 bit float input supported";
+        format = sampleFormat(fi);
+        if (format < 0) {
+            err_prompt = "only 8-16 bit integer or 16/32 bit float input supported";
             break;
         }
 
-        gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", 0, &err));
-        if (gpuId < 0 || gpuId >= ncnn::get_gpu_count()) {
-            err_prompt = "invalid 'gpu_id'";
-            break;
+        matrix = 0;
+        if (fi->colorFamily == cmYUV) {
+            matrix = int64ToIntS(vsapi->propGetInt(in, "matrix", 0, &err));
+            if (err)
+                matrix = 1;
+            if (matrix != 1 && matrix != 5 && matrix != 6 && matrix != 9) {
+                err_prompt = "'matrix' must be 1, 5, 6 or 9";
+                break;
+            }
         }
 
+        const int numGpuIds = vsapi->propNumElements(in, "gpu_id");
+        for (int i = 0; i < std::max(numGpuIds, 1); i++) {
+            int gpuId = int64ToIntS(vsapi->propGetInt(in, "gpu_id", i, &err));
+            if (gpuId >= 0 && !gpuInstanceOk) {
+                err_prompt = "create gpu instance failed";
+                break;
+            }
+            if (gpuId < -1 || gpuId >= ncnn::get_gpu_count()) {
+                err_prompt = "invalid 'gpu_id'";
+                break;
+            }
+            if (std::find(gpuIds.begin(), gpuIds.end(), gpuId) != gpuIds.end()) {
+                err_prompt = "duplicate 'gpu_id'";
+                break;
+            }
+            gpuIds.push_back(gpuId);
+        }
+        if (err_prompt)
+            break;
+
         noise = int64ToIntS(vsapi->propGetInt(in, "noise", 0, &err));
         if (noise < -1 || noise > 3) {
             err_prompt = "'noise' must be -1, 0, 1, 2, or 3";
@@ -148,62 +1151,182 @@ static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCo
         scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
         if (err)
             scale = 2;
-        if (scale != 1 && scale != 2) {
-            err_prompt = "'scale' must be 1 or 2";
+        if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+            err_prompt = "'scale' must be 1, 2, 4 or 8";
             break;
         }
 
-        model = int64ToIntS(vsapi->propGetInt(in, "model", 0, &err));
-        if (model < 0 || model > 2) {
-            err_prompt = "'model' must be 0, 1 or 2";
+        const int numModels = vsapi->propNumElements(in, "model");
+        for (int i = 0; i < std::max(numModels, 1); i++) {
+            model = int64ToIntS(vsapi->propGetInt(in, "model", i, &err));
+            if (model < 0 || model > 2) {
+                err_prompt = "'model' must be 0, 1 or 2";
+                break;
+            }
+            passes.push_back(Pass{ model, -1, 2, 0, {}, {}, {} });
+        }
+        if (err_prompt)
+            break;
+        model = passes[0].model;
+
+        // a single model repeats until scale is reached, a list runs each model once. Every pass
+        // doubles the size, except a leading scale=1 denoise pass when the list has one more model.
+        int doublings = 0;
+        while ((1 << doublings) < scale)
+            doublings++;
+        if (passes.size() == 1)
+            passes.resize(std::max(doublings, 1), passes[0]);
+        if (static_cast<int>(passes.size()) != doublings && static_cast<int>(passes.size()) != doublings + 1) {
+            err_prompt = "'scale' must be 2 to the power of the number of models, or half of that";
             break;
         }
+        for (size_t k = 0; k < passes.size(); k++) {
+            passes[k].scale = k == 0 && static_cast<int>(passes.size()) == doublings + 1 ? 1 : 2;
+            passes[k].noise = k == 0 ? noise : -1;
+        }
 
         precision = int64ToIntS(vsapi->propGetInt(in, "precision", 0, &err));
         if (err)
             precision = 16;
-        if (precision != 16 && precision != 32) {
-            err_prompt = "'precision' must be 16 or 32";
+        if (precision != 8 && precision != 16 && precision != 32) {
+            err_prompt = "'precision' must be 8, 16 or 32";
+            break;
+        }
+        if (precision == 8 && std::any_of(gpuIds.begin(), gpuIds.end(), [](int gpuId) { return gpuId >= 0; })) {
+            err_prompt = "'precision=8' runs on the cpu only, use 'gpu_id=-1'";
+            break;
+        }
+
+        // -1 measures and checks the ncnn paths per device and model, others are Waifu2x::OPT_ flags
+        optProfile = int64ToIntS(vsapi->propGetInt(in, "opt_profile", 0, &err));
+        if (optProfile < -1 || optProfile > Waifu2x::OPT_ALL) {
+            err_prompt = "'opt_profile' must be between -1 and 15";
             break;
         }
 
-        tta = int64ToIntS(vsapi->propGetInt(in, "tta", 0, &err));
+        // tta stays a bool with all 8 orientations, tta_mode picks the number of orientations averaged
+        // as in w2xnvk-bench and overrides it
+        const int64_t ttaFlag = vsapi->propGetInt(in, "tta", 0, &err);
+        if (ttaFlag != 0 && ttaFlag != 1) {
+            err_prompt = "'tta' must be 0 or 1, use 'tta_mode' for 2 or 4 orientations";
+            break;
+        }
+        tta = int64ToIntS(vsapi->propGetInt(in, "tta_mode", 0, &err));
         if (err)
-            tta = 0;
-        if (tta != 0)
-            tta = 1;
+            tta = ttaFlag ? 8 : 1;
+        if (tta != 1 && tta != 2 && tta != 4 && tta != 8) {
+            err_prompt = "'tta_mode' must be 1, 2, 4 or 8";
+            break;
+        }
 
-        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
-        if (customGpuThread > 0) {
-            gpuThread = customGpuThread;
+        batch = !!vsapi->propGetInt(in, "batch", 0, &err);
+        if (batch && std::any_of(passes.begin(), passes.end(), [](const Pass &pass) { return pass.model == 2; })) {
+            err_prompt = "'batch' is not supported by cunet";
+            break;
+        }
+
+        d.stats = !!vsapi->propGetInt(in, "stats", 0, &err);
+
+        dedupFrames = int64ToIntS(vsapi->propGetInt(in, "dedup", 0, &err));
+        if (dedupFrames < 0) {
+            err_prompt = "'dedup' must be greater than or equal to 0";
+            break;
         }
-        else {
-            gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
+
+        dedupThreshold = vsapi->propGetFloat(in, "dedup_threshold", 0, &err);
+        if (dedupThreshold < 0 || dedupThreshold > 1) {
+            err_prompt = "'dedup_threshold' must be between 0 and 1";
+            break;
         }
-        gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
 
-        int tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
-        if (tileSize == 0) {
-            double vram = ncnn::get_gpu_device(gpuId)->get_heap_budget(); // in MByte
-            double factor = (precision == 32 ? 2 : 1) * (model == 2 ? 1.5 : 1) * gpuThread;
-            if (vram / factor > 900)
-                tileSize = 360;
-            else if (vram / factor > 450)
-                tileSize = 240;
-            else
-                tileSize = 180;
+        // roi is left, top, width and height in source pixels
+        const int numRoi = vsapi->propNumElements(in, "roi");
+        const bool roiAuto = !!vsapi->propGetInt(in, "roi_auto", 0, &err);
+        d.mask = vsapi->propGetNode(in, "roi_mask", 0, &err);
+        if ((numRoi >= 0) + roiAuto + (d.mask != nullptr) > 1) {
+            err_prompt = "only one of 'roi', 'roi_auto' and 'roi_mask' can be used";
+            break;
         }
-        if (tileSize < 32) {
-            err_prompt = "'tile_size' must be greater than or equal to 32";
+        if (numRoi >= 0) {
+            if (numRoi != 4) {
+                err_prompt = "'roi' must be [left, top, width, height]";
+                break;
+            }
+            d.roi.x0 = int64ToIntS(vsapi->propGetInt(in, "roi", 0, &err));
+            d.roi.y0 = int64ToIntS(vsapi->propGetInt(in, "roi", 1, &err));
+            d.roi.x1 = d.roi.x0 + int64ToIntS(vsapi->propGetInt(in, "roi", 2, &err));
+            d.roi.y1 = d.roi.y0 + int64ToIntS(vsapi->propGetInt(in, "roi", 3, &err));
+            if (d.roi.x0 < 0 || d.roi.y0 < 0 || d.roi.x1 <= d.roi.x0 || d.roi.y1 <= d.roi.y0 ||
+                d.roi.x1 > d.vi.width || d.roi.y1 > d.vi.height) {
+                err_prompt = "'roi' must be a non-empty rectangle inside the clip";
+                break;
+            }
+            d.roiMode = ROI_RECT;
+        } else if (roiAuto) {
+            d.roiMode = ROI_AUTO;
+        } else if (d.mask) {
+            const VSVideoInfo *mvi = vsapi->getVideoInfo(d.mask);
+            if (!isConstantFormat(mvi) || mvi->width != d.vi.width || mvi->height != d.vi.height) {
+                err_prompt = "'roi_mask' must have a constant format and the dimensions of the clip";
+                break;
+            }
+            if (sampleFormat(mvi->format) < 0) {
+                err_prompt = "'roi_mask' must be 8-16 bit integer or 16/32 bit float";
+                break;
+            }
+            d.roiMode = ROI_MASK;
+        }
+
+        tileCache = int64ToIntS(vsapi->propGetInt(in, "tile_cache", 0, &err));
+        if (tileCache < 0) {
+            err_prompt = "'tile_cache' must be greater than or equal to 0";
             break;
         }
-        if (tileSize % 4) {
-            err_prompt = "'tile_size' must be multiple of 4";
+
+        d.lookahead = int64ToIntS(vsapi->propGetInt(in, "lookahead", 0, &err));
+        if (d.lookahead < 0) {
+            err_prompt = "'lookahead' must be greater than or equal to 0";
             break;
         }
-        tileSizeW = tileSizeH = tileSize;
 
-        int tw = int64ToIntS(vsapi->propGetInt(in, "tile_size_w", 0, &err));
+        // streaming moves single tiles, so it takes more of them in flight to keep the device busy
+        stream = !!vsapi->propGetInt(in, "stream", 0, &err);
+
+        pipelineDepth = int64ToIntS(vsapi->propGetInt(in, "pipeline_depth", 0, &err));
+        if (err)
+            pipelineDepth = stream ? 4 : 1;
+        if (pipelineDepth < 1 || pipelineDepth > (stream ? 8 : 3)) {
+            err_prompt = stream ? "'pipeline_depth' must be between 1 and 8 with 'stream'" : "'pipeline_depth' must be 1, 2 or 3";
+            break;
+        }
+
+        int customGpuThread = int64ToIntS(vsapi->propGetInt(in, "gpu_thread", 0, &err));
+
+        cpuThread = int64ToIntS(vsapi->propGetInt(in, "cpu_thread", 0, &err));
+        if (cpuThread < 0) {
+            err_prompt = "'cpu_thread' must be greater than or equal to 0";
+            break;
+        }
+        if (cpuThread == 0)
+            cpuThread = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+        int tileSize = int64ToIntS(vsapi->propGetInt(in, "tile_size", 0, &err));
+        if (tileSize == -1) {
+            // measured per device once the model is known
+            tuneTiles = true;
+            tileSize = 0;
+        } else if (tileSize != 0) {
+            if (tileSize < 32) {
+                err_prompt = "'tile_size' must be greater than or equal to 32";
+                break;
+            }
+            if (tileSize % 4) {
+                err_prompt = "'tile_size' must be multiple of 4";
+                break;
+            }
+        }
+
+        tw = int64ToIntS(vsapi->propGetInt(in, "tile_size_w", 0, &err));
         if (!err) {
             if (tw < 32) {
                 err_prompt = "'tile_size_w' must be greater than or equal to 32";
@@ -213,10 +1336,11 @@ static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCo
                 err_prompt = "'tile_size_w' must be multiple of 4";
                 break;
             }
-            tileSizeW = tw;
+        } else {
+            tw = 0;
         }
 
-        int th = int64ToIntS(vsapi->propGetInt(in, "tile_size_h", 0, &err));
+        th = int64ToIntS(vsapi->propGetInt(in, "tile_size_h", 0, &err));
         if (!err) {
             if (th < 32) {
                 err_prompt = "'tile_size_h' must be greater than or equal to 32";
@@ -226,49 +1350,92 @@ static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCo
                 err_prompt = "'tile_size_h' must be multiple of 4";
                 break;
             }
-            tileSizeH = th;
+        } else {
+            th = 0;
         }
 
-        if (scale == 1 && noise == -1) {
-            err_prompt = "use 'noise=-1' and 'scale=1' at same time is useless";
-            break;
-        }
+        for (int gpuId : gpuIds) {
+            if (gpuId < 0) {
+                // the cpu engine takes one frame at a time and splits its tiles over cpu_thread workers
+                gpuThreads.push_back(1);
+                tileSizesW.push_back(tw ? tw : tileSize ? tileSize : 256);
+                tileSizesH.push_back(th ? th : tileSize ? tileSize : 256);
+                continue;
+            }
 
-        if (scale == 1 && model != 2) {
-            err_prompt = "only cunet model support 'scale=1'";
-            break;
+            int gpuThread;
+            if (customGpuThread > 0) {
+                gpuThread = customGpuThread;
+            }
+            else {
+                gpuThread = int64ToIntS(ncnn::get_gpu_info(gpuId).transfer_queue_count());
+            }
+            gpuThread = std::min(gpuThread, int64ToIntS(ncnn::get_gpu_info(gpuId).compute_queue_count()));
+            gpuThreads.push_back(gpuThread);
+
+            const int deviceTileSize = tileSize ? tileSize : autoTileSize(gpuId, precision, model, gpuThread, pipelineDepth, tta, batch);
+            tileSizesW.push_back(tw ? tw : deviceTileSize);
+            tileSizesH.push_back(th ? th : deviceTileSize);
         }
 
-        // set model path
         const std::string pluginFilePath{ vsapi->getPluginPath(vsapi->getPluginById("net.nlzy.vsw2xnvk", core)) };
         const std::string pluginDir = pluginFilePath.substr(0, pluginFilePath.find_last_of('/'));
 
-        std::string modelsDir;
-        if (model == 0)
-            modelsDir += pluginDir + "/models-upconv_7_anime_style_art_rgb/";
-        else if (model == 1)
-            modelsDir += pluginDir + "/models-upconv_7_photo/";
-        else
-            modelsDir += pluginDir + "/models-cunet/";
-
-        std::string modelName;
-        if (noise == -1)
-            modelName = "scale2.0x_model";
-        else if (scale == 1)
-            modelName = "noise" + std::to_string(noise) + "_model";
-        else
-            modelName = "noise" + std::to_string(noise) + "_scale2.0x_model";
-
-        paramPath = modelsDir + modelName + ".param";
-        modelPath = modelsDir + modelName + ".bin";
-
-        // check model file readable
-        std::ifstream pf(paramPath);
-        std::ifstream mf(modelPath);
-        if (!pf.good() || !mf.good()) {
-            err_prompt = "can't open model file";
-            break;
+        for (Pass &pass : passes) {
+            if (pass.scale == 1 && pass.noise == -1) {
+                err_prompt = "use 'noise=-1' and 'scale=1' at same time is useless";
+                break;
+            }
+
+            if (pass.scale == 1 && pass.model != 2) {
+                err_prompt = "only cunet model support 'scale=1'";
+                break;
+            }
+
+            // set model path
+            std::string modelsDir;
+            if (pass.model == 0)
+                modelsDir += pluginDir + "/models-upconv_7_anime_style_art_rgb/";
+            else if (pass.model == 1)
+                modelsDir += pluginDir + "/models-upconv_7_photo/";
+            else
+                modelsDir += pluginDir + "/models-cunet/";
+
+            std::string modelName;
+            if (pass.noise == -1)
+                modelName = "scale2.0x_model";
+            else if (pass.scale == 1)
+                modelName = "noise" + std::to_string(pass.noise) + "_model";
+            else
+                modelName = "noise" + std::to_string(pass.noise) + "_scale2.0x_model";
+
+            // int8 models are made from the fp32 ones by the quantize-models build target
+            if (precision == 8)
+                modelName += ".int8";
+
+            pass.paramPath = modelsDir + modelName + ".param";
+            pass.modelPath = modelsDir + modelName + ".bin";
+
+            // check model file readable
+            std::ifstream pf(pass.paramPath);
+            std::ifstream mf(pass.modelPath);
+            if (!pf.good() || !mf.good()) {
+                err_prompt = precision == 8 ? "can't open int8 model file, see 'precision' in README" : "can't open model file";
+                break;
+            }
+
+            if (pass.model == 2 && pass.scale == 1)
+                pass.prepadding = 28;
+            else if (pass.model == 2)
+                pass.prepadding = 18;
+            else
+                pass.prepadding = 7;
         }
+        if (err_prompt)
+            break;
+
+        tuneCacheFile = cacheFilePath(pluginDir, "w2xnvk_tile_size.txt");
+        optProfileCacheFile = cacheFilePath(pluginDir, "w2xnvk_opt_profile.txt");
 
         break;
     } while (false);
@@ -276,23 +1443,69 @@ static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCo
     if (err_prompt) {
         vsapi->setError(out, (std::string{"Waifu2x-NCNN-Vulkan: "} + err_prompt).c_str());
         vsapi->freeNode(d.node);
+        vsapi->freeNode(d.mask);
         tryDestoryGpuInstance();
         return;
     }
 
-    int prepadding;
-    if (model == 2 && scale == 1)
-        prepadding = 28;
-    else if (model == 2)
-        prepadding = 18;
-    else
-        prepadding = 7;
+    // every pass is checked on one tile of the size it will run with, before tiles are tuned with the result
+    for (Pass &pass : passes) {
+        for (size_t i = 0; i < gpuIds.size(); i++) {
+            if (gpuIds[i] < 0)
+                pass.optProfiles.push_back(0);
+            else if (optProfile >= 0)
+                pass.optProfiles.push_back(optProfile);
+            else
+                pass.optProfiles.push_back(tuneOptProfile(gpuIds[i], tileSizesW[i], tileSizesH[i], pass.scale, precision, pass.prepadding,
+                                                          pass.paramPath, pass.modelPath, optProfileCacheFile, vsapi));
+        }
+    }
+
+    // only the first pass is measured, later ones use the same tile size on their larger frames
+    if (tuneTiles) {
+        for (size_t i = 0; i < gpuIds.size(); i++) {
+            if (gpuIds[i] < 0 || (tw && th))
+                continue;
+            const Pass &first = passes[0];
+            const std::pair<int, int> tuned = tuneTileSize(gpuIds[i], gpuThreads[i], d.vi, first.scale, first.model, precision,
+                                                           first.optProfiles[i], tta, batch, first.prepadding, pipelineDepth, stream, format,
+                                                           matrix, first.paramPath, first.modelPath, tuneCacheFile, vsapi);
+            tileSizesW[i] = tw ? tw : tuned.first;
+            tileSizesH[i] = th ? th : tuned.second;
+        }
+    }
 
-    d.waifu2x = new Waifu2x(d.vi.width, d.vi.height, scale, tileSizeW, tileSizeH, gpuId, gpuThread, precision, tta, prepadding, paramPath, modelPath);
+    d.scheduler = new Scheduler;
+    for (size_t i = 0; i < gpuIds.size(); i++) {
+        // built from the last pass back, each pass owns the one reading its output
+        Waifu2x *engine = nullptr;
+        double vramMb = 0;
+        for (size_t k = passes.size(); k-- > 0;) {
+            int passWidth = d.vi.width, passHeight = d.vi.height;
+            for (size_t j = 0; j < k; j++) {
+                passWidth *= passes[j].scale;
+                passHeight *= passes[j].scale;
+            }
+            vramMb += passVramEstimate(tileSizesW[i], tileSizesH[i], precision, passes[k].model, pipelineDepth, tta, batch,
+                                       passWidth * passes[k].scale, passHeight * passes[k].scale, k + 1 < passes.size());
+            engine = new Waifu2x(passWidth, passHeight, passes[k].scale, tileSizesW[i], tileSizesH[i], gpuIds[i], gpuThreads[i], cpuThread,
+                                 precision, passes[k].optProfiles[i], tta, batch, passes[k].prepadding, pipelineDepth, stream, format,
+                                 d.vi.format->bitsPerSample, matrix, static_cast<size_t>(tileCache) << 20,
+                                 passes[k].paramPath, passes[k].modelPath, engine, k > 0);
+        }
+        d.scheduler->add(engine, gpuIds[i], gpuThreads[i], vramMb);
+    }
     d.vi.width *= scale;
     d.vi.height *= scale;
+    d.dedup = dedupFrames > 0 ? new FrameCache(dedupFrames, dedupThreshold, vsapi) : nullptr;
+    d.prefetch = d.lookahead > 0 ? new Prefetcher(d.lookahead, vsapi) : nullptr;
 
     auto *data = new FilterData{ d };
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        data->id = statsNextId++;
+        statsInstances.push_back(data);
+    }
 
     vsapi->createFilter(in, out, "Waifu2x", filterInit, filterGetFrame, filterFree, fmParallel, 0, data, core);
 }
@@ -302,13 +1515,29 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
     registerFunc("Waifu2x", "clip:clip;"
                             "noise:int:opt;"
                             "scale:int:opt;"
-                            "model:int:opt;"
+                            "model:int[]:opt;"
                             "tile_size:int:opt;"
-                            "gpu_id:int:opt;"
+                            "gpu_id:int[]:opt;"
                             "gpu_thread:int:opt;"
+                            "cpu_thread:int:opt;"
                             "precision:int:opt;"
+                            "opt_profile:int:opt;"
                             "tile_size_w:int:opt;"
                             "tile_size_h:int:opt;"
                             "tta:int:opt;"
+                            "tta_mode:int:opt;"
+                            "batch:int:opt;"
+                            "pipeline_depth:int:opt;"
+                            "stream:int:opt;"
+                            "lookahead:int:opt;"
+                            "matrix:int:opt;"
+                            "stats:int:opt;"
+                            "tile_cache:int:opt;"
+                            "dedup:int:opt;"
+                            "dedup_threshold:float:opt;"
+                            "roi:int[]:opt;"
+                            "roi_auto:int:opt;"
+                            "roi_mask:clip:opt;"
                             , filterCreate, nullptr, plugin);
+    registerFunc("Stats", "", statsCreate, nullptr, plugin);
 }
@@ -0,0 +1,363 @@
+/*
+  MIT License
+
+  Copyright (c) 2019 nihui
+  Copyright (c) 2019-2020 NaLan ZeYu
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// w2xnvk-bench: runs Waifu2x::process over a matrix of settings without VapourSynth
+// and prints throughput, latency percentiles and per-stage times as JSON
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gpu.h"
+#include "waifu2x.hpp"
+
+struct Options {
+    std::string modelsDir = ".";
+    std::string input;
+    std::string format = "u8";
+    int width = 1920;
+    int height = 1080;
+    int frames = 20;
+    int warmup = 2;
+    int profileFrames = 3;
+    int pipelineDepth = 0;
+    int gpuId = 0;
+    std::vector<int> models{ 0 };
+    std::vector<int> scales{ 2 };
+    std::vector<int> noises{ 0 };
+    std::vector<int> tileSizes{ 256 };
+    std::vector<int> precisions{ 16 };
+    std::vector<int> optProfiles{ 0 };
+    std::vector<int> ttas{ 1 };
+    std::vector<int> batches{ 0 };
+    std::vector<int> gpuThreads{ 1 };
+    std::vector<int> streams{ 0 };
+};
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: w2xnvk-bench [options]\n"
+            "  --models-dir DIR       directory holding the models-* folders (default .)\n"
+            "  --gpu ID               gpu device, -1 for cpu (default 0)\n"
+            "  --width W --height H   frame size (default 1920x1080)\n"
+            "  --format F             u8, u10, u16, fp16 or fp32 planar rgb (default u8)\n"
+            "  --input FILE           raw planar frames of that size and format, synthetic if omitted\n"
+            "  --frames N             timed frames per configuration (default 20)\n"
+            "  --warmup N             untimed frames per configuration (default 2)\n"
+            "  --profile-frames N     frames run with per-stage timing (default 3)\n"
+            "  --pipeline-depth N     tile rows in flight, or tiles with --stream 1: 1-3, or 1-8 streaming\n"
+            "                         (default 1, or 4 streaming, as in the plugin)\n"
+            "  lists, comma separated:\n"
+            "  --model 0,1,2 --scale 1,2 --noise -1..3 --tile-size 256 --precision 8,16,32 --tta-mode 1,2,4,8 --batch 0,1\n"
+            "  --gpu-thread 1 --opt-profile 0..15 --stream 0,1\n");
+}
+
+static bool parseList(const char *arg, std::vector<int> &out) {
+    out.clear();
+    std::istringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        char *end;
+        const long v = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end)
+            return false;
+        out.push_back(static_cast<int>(v));
+    }
+    return !out.empty();
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        const std::string name = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        const char *value = argv[++i];
+        if (name == "--models-dir")
+            opt.modelsDir = value;
+        else if (name == "--input")
+            opt.input = value;
+        else if (name == "--format")
+            opt.format = value;
+        else if (name == "--width")
+            opt.width = atoi(value);
+        else if (name == "--height")
+            opt.height = atoi(value);
+        else if (name == "--frames")
+            opt.frames = atoi(value);
+        else if (name == "--warmup")
+            opt.warmup = atoi(value);
+        else if (name == "--profile-frames")
+            opt.profileFrames = atoi(value);
+        else if (name == "--pipeline-depth")
+            opt.pipelineDepth = atoi(value);
+        else if (name == "--gpu")
+            opt.gpuId = atoi(value);
+        else if (!((name == "--model" && parseList(value, opt.models)) ||
+                   (name == "--scale" && parseList(value, opt.scales)) ||
+                   (name == "--noise" && parseList(value, opt.noises)) ||
+                   (name == "--tile-size" && parseList(value, opt.tileSizes)) ||
+                   (name == "--precision" && parseList(value, opt.precisions)) ||
+                   (name == "--opt-profile" && parseList(value, opt.optProfiles)) ||
+                   (name == "--tta-mode" && parseList(value, opt.ttas)) ||
+                   (name == "--batch" && parseList(value, opt.batches)) ||
+                   (name == "--gpu-thread" && parseList(value, opt.gpuThreads)) ||
+                   (name == "--stream" && parseList(value, opt.streams))))
+            return false;
+    }
+    return opt.width > 0 && opt.height > 0 && opt.frames > 0 && opt.warmup >= 0 && opt.profileFrames >= 0 &&
+           opt.pipelineDepth >= 0 && opt.pipelineDepth <= 8;
+}
+
+static std::string jsonString(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+static double percentile(std::vector<double> sorted, double p) {
+    std::sort(sorted.begin(), sorted.end());
+    const size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p * (sorted.size() - 1) + 0.5));
+    return sorted[i];
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+
+    int format, bits, bytes;
+    if (!Waifu2x::parse_format(opt.format, format, bits, bytes)) {
+        usage();
+        return 1;
+    }
+
+    const ptrdiff_t srcStride = static_cast<ptrdiff_t>(opt.width) * bytes;
+    const size_t srcPlane = srcStride * opt.height;
+    const size_t frameSize = srcPlane * RGB_CHANNELS;
+
+    // input frames are cycled through, a synthetic one is a gradient that stays inside the legal range
+    std::vector<std::vector<uint8_t>> inputs;
+    if (!opt.input.empty()) {
+        std::ifstream f(opt.input, std::ios::binary);
+        std::vector<uint8_t> frame(frameSize);
+        while (inputs.size() < static_cast<size_t>(opt.frames) && f.read(reinterpret_cast<char *>(frame.data()), frameSize))
+            inputs.push_back(frame);
+        if (inputs.empty()) {
+            fprintf(stderr, "can't read a %dx%d %s frame from %s\n", opt.width, opt.height, opt.format.c_str(), opt.input.c_str());
+            return 1;
+        }
+    } else {
+        std::vector<uint8_t> frame(frameSize);
+        for (int c = 0; c < RGB_CHANNELS; c++) {
+            for (int y = 0; y < opt.height; y++) {
+                for (int x = 0; x < opt.width; x++) {
+                    const float v = static_cast<float>((x + y * (c + 1)) % 256) / 255.f;
+                    uint8_t *p = frame.data() + srcPlane * c + srcStride * y + static_cast<size_t>(x) * bytes;
+                    if (format == Waifu2x::FORMAT_U8) {
+                        *p = static_cast<uint8_t>(v * 255.f);
+                    } else if (format == Waifu2x::FORMAT_U16) {
+                        const uint16_t s = static_cast<uint16_t>(v * ((1 << bits) - 1));
+                        memcpy(p, &s, 2);
+                    } else if (format == Waifu2x::FORMAT_FP16) {
+                        const unsigned short s = ncnn::float32_to_float16(v);
+                        memcpy(p, &s, 2);
+                    } else {
+                        memcpy(p, &v, 4);
+                    }
+                }
+            }
+        }
+        inputs.push_back(frame);
+    }
+
+    if (opt.gpuId >= 0) {
+        if (ncnn::create_gpu_instance() != 0 || opt.gpuId >= ncnn::get_gpu_count()) {
+            fprintf(stderr, "gpu %d not available\n", opt.gpuId);
+            return 1;
+        }
+    }
+
+    const std::string device = opt.gpuId >= 0 ? ncnn::get_gpu_info(opt.gpuId).device_name() : "cpu";
+    const int cpuThread = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+    std::cout << "{\n  \"device\": " << jsonString(device);
+    if (opt.gpuId >= 0)
+        std::cout << ",\n  \"driver_version\": " << ncnn::get_gpu_info(opt.gpuId).driver_version();
+    std::cout << ",\n  \"width\": " << opt.width << ",\n  \"height\": " << opt.height
+              << ",\n  \"format\": " << jsonString(opt.format) << ",\n  \"runs\": [";
+
+    bool first = true;
+    for (int model : opt.models)
+    for (int scale : opt.scales)
+    for (int noise : opt.noises)
+    for (int tileSize : opt.tileSizes)
+    for (int precision : opt.precisions)
+    for (int optProfile : opt.optProfiles)
+    for (int tta : opt.ttas)
+    for (int batch : opt.batches)
+    for (int gpuThread : opt.gpuThreads)
+    for (int stream : opt.streams) {
+        const int pipelineDepth = opt.pipelineDepth ? opt.pipelineDepth : stream ? 4 : 1;
+
+        // same rules and model layout as the plugin
+        if (pipelineDepth > (stream ? 8 : 3) || model < 0 || model > 2 || noise < -1 || noise > 3 || (scale != 1 && scale != 2) ||
+            (scale == 1 && (noise == -1 || model != 2)) || (tta != 1 && tta != 2 && tta != 4 && tta != 8) ||
+            (batch && (tta == 1 || model == 2)) || tileSize < 32 || tileSize % 4 ||
+            (precision != 8 && precision != 16 && precision != 32) || (precision == 8 && opt.gpuId >= 0) || optProfile < 0 || optProfile > Waifu2x::OPT_ALL || gpuThread < 1) {
+            fprintf(stderr, "skipping model=%d scale=%d noise=%d tile_size=%d precision=%d opt_profile=%d tta_mode=%d batch=%d gpu_thread=%d stream=%d pipeline_depth=%d\n",
+                    model, scale, noise, tileSize, precision, optProfile, tta, batch, gpuThread, stream, pipelineDepth);
+            continue;
+        }
+        // same cap as the plugin, more threads than queues only wait on each other
+        if (opt.gpuId < 0)
+            gpuThread = 1;
+        else
+            gpuThread = std::min(gpuThread, static_cast<int>(ncnn::get_gpu_info(opt.gpuId).compute_queue_count()));
+
+        std::string modelsDir = opt.modelsDir;
+        if (model == 0)
+            modelsDir += "/models-upconv_7_anime_style_art_rgb/";
+        else if (model == 1)
+            modelsDir += "/models-upconv_7_photo/";
+        else
+            modelsDir += "/models-cunet/";
+
+        std::string modelName;
+        if (noise == -1)
+            modelName = "scale2.0x_model";
+        else if (scale == 1)
+            modelName = "noise" + std::to_string(noise) + "_model";
+        else
+            modelName = "noise" + std::to_string(noise) + "_scale2.0x_model";
+        if (precision == 8)
+            modelName += ".int8";
+
+        const std::string paramPath = modelsDir + modelName + ".param";
+        const std::string modelPath = modelsDir + modelName + ".bin";
+        if (!std::ifstream(paramPath).good() || !std::ifstream(modelPath).good()) {
+            fprintf(stderr, "can't open model file %s\n", paramPath.c_str());
+            continue;
+        }
+
+        int prepadding;
+        if (model == 2 && scale == 1)
+            prepadding = 28;
+        else if (model == 2)
+            prepadding = 18;
+        else
+            prepadding = 7;
+
+        std::unique_ptr<Waifu2x> waifu2x(new Waifu2x(opt.width, opt.height, scale, tileSize, tileSize, opt.gpuId, gpuThread, cpuThread,
+                                                     precision, optProfile, tta, batch, prepadding, pipelineDepth, !!stream, format, bits, 0, 0,
+                                                     paramPath, modelPath));
+
+        const ptrdiff_t dstStride = srcStride * scale;
+        const size_t dstPlane = dstStride * opt.height * scale;
+        std::vector<std::vector<uint8_t>> outputs(gpuThread, std::vector<uint8_t>(dstPlane * RGB_CHANNELS));
+
+        auto runFrame = [&](int n, int t, Waifu2x::StageTimes *times) {
+            const uint8_t *srcp[RGB_CHANNELS];
+            uint8_t *dstp[RGB_CHANNELS];
+            for (int plane = 0; plane < RGB_CHANNELS; plane++) {
+                srcp[plane] = inputs[n % inputs.size()].data() + srcPlane * plane;
+                dstp[plane] = outputs[t].data() + dstPlane * plane;
+            }
+            return waifu2x->process(srcp, dstp, srcStride, dstStride, times);
+        };
+
+        int err = Waifu2x::ERROR_OK;
+        for (int n = 0; n < opt.warmup && err == Waifu2x::ERROR_OK; n++)
+            err = runFrame(n, 0, nullptr);
+
+        // gpu_thread workers pull frames like VapourSynth threads would
+        std::vector<double> latencies(opt.frames);
+        std::atomic<int> next{ 0 };
+        std::atomic<int> failed{ err != Waifu2x::ERROR_OK };
+        std::vector<std::thread> workers;
+        const auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < gpuThread && !failed; t++) {
+            workers.emplace_back([&, t] {
+                for (int n = next++; n < opt.frames && !failed; n = next++) {
+                    const auto frameStart = std::chrono::steady_clock::now();
+                    if (runFrame(n, t, nullptr) != Waifu2x::ERROR_OK)
+                        failed = 1;
+                    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - frameStart;
+                    latencies[n] = elapsed.count();
+                }
+            });
+        }
+        for (std::thread &worker : workers)
+            worker.join();
+        const std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+
+        // stages are timed on separate frames, timing each stage serializes the row pipeline
+        Waifu2x::StageTimes stages;
+        for (int n = 0; n < opt.profileFrames && !failed; n++) {
+            if (runFrame(n, 0, &stages) != Waifu2x::ERROR_OK)
+                failed = 1;
+        }
+
+        std::cout << (first ? "\n" : ",\n") << "    {\"model\": " << model << ", \"scale\": " << scale << ", \"noise\": " << noise
+                  << ", \"tile_size\": " << tileSize << ", \"precision\": " << precision << ", \"opt_profile\": " << optProfile << ", \"tta_mode\": " << tta
+                  << ", \"batch\": " << batch
+                  << ", \"gpu_thread\": " << gpuThread << ", \"pipeline_depth\": " << pipelineDepth << ", \"stream\": " << stream;
+        first = false;
+        if (failed) {
+            std::cout << ", \"error\": true}";
+            continue;
+        }
+
+        const double perFrame = opt.profileFrames > 0 ? 1.0 / opt.profileFrames : 0;
+        std::cout << ", \"fps\": " << opt.frames / total.count()
+                  << ", \"latency_ms\": {\"p50\": " << percentile(latencies, 0.5) << ", \"p90\": " << percentile(latencies, 0.9)
+                  << ", \"p99\": " << percentile(latencies, 0.99) << ", \"max\": " << percentile(latencies, 1.0) << "}"
+                  << ", \"stage_host_ms\": {\"host_copy\": " << stages.host_copy * perFrame << ", \"upload\": " << stages.upload * perFrame
+                  << ", \"preproc\": " << stages.preproc * perFrame << ", \"inference\": " << stages.inference * perFrame
+                  << ", \"postproc\": " << stages.postproc * perFrame << ", \"download\": " << stages.download * perFrame << "}}";
+    }
+
+    std::cout << "\n  ]\n}\n";
+
+    if (opt.gpuId >= 0)
+        ncnn::destroy_gpu_instance();
+
+    return 0;
+}
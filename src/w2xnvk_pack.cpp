@@ -0,0 +1,149 @@
+/*
+  MIT License
+
+  Copyright (c) 2019 nihui
+  Copyright (c) 2019-2020 NaLan ZeYu
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// w2xnvk-pack: writes the .w2xpack file the plugin maps in place of a model's .param and .bin,
+// see Waifu2x::PackHeader
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "net.h"
+#include "waifu2x.hpp"
+
+struct Options {
+    std::string param;
+    std::string bin;
+    std::string out;
+    std::string check;
+};
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: w2xnvk-pack [options]\n"
+            "  --param FILE --bin FILE  model to pack\n"
+            "  --out FILE               pack written, next to the .param as .w2xpack to be used by the plugin\n"
+            "  --check FILE             verify the checksum of an existing pack instead\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        const std::string name = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        const char *value = argv[++i];
+        if (name == "--param")
+            opt.param = value;
+        else if (name == "--bin")
+            opt.bin = value;
+        else if (name == "--out")
+            opt.out = value;
+        else if (name == "--check")
+            opt.check = value;
+        else
+            return false;
+    }
+    return !opt.check.empty() || (!opt.param.empty() && !opt.bin.empty() && !opt.out.empty());
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &data) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+        return false;
+    data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    return !f.bad();
+}
+
+// the plugin only compares the header and the .param text, damaged weights show up here
+static int check(const std::string &path) {
+    std::vector<uint8_t> pack;
+    Waifu2x::PackHeader header;
+    if (!readFile(path, pack) || pack.size() < sizeof(header)) {
+        fprintf(stderr, "can't read %s\n", path.c_str());
+        return 1;
+    }
+    memcpy(&header, pack.data(), sizeof(header));
+    if (memcmp(header.magic, "W2XPACK", 8) != 0 || header.version != Waifu2x::PACK_VERSION ||
+        header.model_offset + header.model_size != pack.size() ||
+        Waifu2x::hash_bytes(pack.data() + sizeof(header), pack.size() - sizeof(header)) != header.checksum) {
+        fprintf(stderr, "%s is damaged or not a pack of this version\n", path.c_str());
+        return 1;
+    }
+    fprintf(stderr, "%s: ok\n", path.c_str());
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    if (!opt.check.empty())
+        return check(opt.check);
+
+    std::vector<uint8_t> param, model;
+    if (!readFile(opt.param, param) || !readFile(opt.bin, model) || param.empty() || model.empty()) {
+        fprintf(stderr, "can't read model %s\n", opt.param.c_str());
+        return 1;
+    }
+
+    Waifu2x::PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "W2XPACK", 8);
+    header.version = Waifu2x::PACK_VERSION;
+    header.param_size = param.size() + 1;
+    header.model_offset = (sizeof(header) + header.param_size + Waifu2x::PACK_ALIGN - 1) / Waifu2x::PACK_ALIGN * Waifu2x::PACK_ALIGN;
+    header.model_size = model.size();
+    header.source_param_size = param.size();
+    header.source_model_size = model.size();
+
+    std::vector<uint8_t> pack(header.model_offset + header.model_size, 0);
+    memcpy(pack.data() + sizeof(header), param.data(), param.size());
+    memcpy(pack.data() + header.model_offset, model.data(), model.size());
+    header.checksum = Waifu2x::hash_bytes(pack.data() + sizeof(header), pack.size() - sizeof(header));
+    memcpy(pack.data(), &header, sizeof(header));
+
+    // the plugin loads packs the same way, one ncnn can't read all of would be ignored there
+    ncnn::Net net;
+    net.opt.use_vulkan_compute = false;
+    if (net.load_param_mem(reinterpret_cast<const char *>(pack.data() + sizeof(header))) != 0 ||
+        static_cast<uint64_t>(net.load_model(pack.data() + header.model_offset)) != header.model_size) {
+        fprintf(stderr, "ncnn can't load %s and %s\n", opt.param.c_str(), opt.bin.c_str());
+        return 1;
+    }
+
+    std::ofstream out(opt.out, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(pack.data()), pack.size());
+    out.close();
+    if (!out) {
+        fprintf(stderr, "can't write %s\n", opt.out.c_str());
+        return 1;
+    }
+    fprintf(stderr, "%s: %d bytes of weights\n", opt.out.c_str(), static_cast<int>(header.model_size));
+    return 0;
+}
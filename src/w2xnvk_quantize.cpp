@@ -0,0 +1,356 @@
+/*
+  MIT License
+
+  Copyright (c) 2019 nihui
+  Copyright (c) 2019-2020 NaLan ZeYu
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// w2xnvk-quantize: writes the calibration table ncnn2int8 needs to make the int8 model loaded
+// by precision=8, and compares an int8 model against the fp32 one on the same frames
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "net.h"
+#include "layer/convolution.h"
+#include "waifu2x.hpp"
+
+struct Options {
+    std::string mode;
+    std::string param;
+    std::string bin;
+    std::string int8Param;
+    std::string int8Bin;
+    std::string table;
+    std::string input;
+    std::string format = "u8";
+    int width = 0;
+    int height = 0;
+    int frames = 8;
+    int tiles = 16;
+    int tileSize = 128;
+    int scale = 2;
+    int prepadding = 7;
+};
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: w2xnvk-quantize table|compare [options]\n"
+            "  --param FILE --bin FILE  fp32 model\n"
+            "  --input FILE             raw planar rgb frames, the calibration or test set\n"
+            "  --width W --height H     frame size\n"
+            "  --format F               u8, u10, u16, fp16 or fp32 (default u8)\n"
+            "  --frames N               frames read from input (default 8)\n"
+            "  --prepadding N           7 for upconv_7, 18 or 28 for cunet (default 7)\n"
+            "  table:\n"
+            "  --table FILE             calibration table written for ncnn2int8\n"
+            "  --tiles N                tiles sampled per frame (default 16)\n"
+            "  --tile-size N            (default 128)\n"
+            "  compare:\n"
+            "  --int8-param FILE --int8-bin FILE\n"
+            "  --scale N                1 or 2 (default 2)\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    if (argc < 2)
+        return false;
+    opt.mode = argv[1];
+    for (int i = 2; i < argc; i++) {
+        const std::string name = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        const char *value = argv[++i];
+        if (name == "--param")
+            opt.param = value;
+        else if (name == "--bin")
+            opt.bin = value;
+        else if (name == "--int8-param")
+            opt.int8Param = value;
+        else if (name == "--int8-bin")
+            opt.int8Bin = value;
+        else if (name == "--table")
+            opt.table = value;
+        else if (name == "--input")
+            opt.input = value;
+        else if (name == "--format")
+            opt.format = value;
+        else if (name == "--width")
+            opt.width = atoi(value);
+        else if (name == "--height")
+            opt.height = atoi(value);
+        else if (name == "--frames")
+            opt.frames = atoi(value);
+        else if (name == "--tiles")
+            opt.tiles = atoi(value);
+        else if (name == "--tile-size")
+            opt.tileSize = atoi(value);
+        else if (name == "--scale")
+            opt.scale = atoi(value);
+        else if (name == "--prepadding")
+            opt.prepadding = atoi(value);
+        else
+            return false;
+    }
+    if (opt.mode == "table" && opt.table.empty())
+        return false;
+    if (opt.mode == "compare" && (opt.int8Param.empty() || opt.int8Bin.empty() || (opt.scale != 1 && opt.scale != 2)))
+        return false;
+    return (opt.mode == "table" || opt.mode == "compare") && !opt.param.empty() && !opt.bin.empty() && !opt.input.empty() &&
+           opt.width > 0 && opt.height > 0 && opt.frames > 0 && opt.tiles > 0 && opt.tileSize >= 32 && opt.prepadding >= 0;
+}
+
+static const int histogramBins = 2048;
+static const int quantizedLevels = 128;
+
+// the threshold, in bins, that loses the least information when everything below it is squeezed
+// into quantizedLevels levels and everything above it is clipped. Same search as ncnn2table.
+static int klThreshold(const std::vector<double> &hist) {
+    int best = histogramBins;
+    double bestKl = DBL_MAX;
+    for (int t = quantizedLevels; t < histogramBins; t++) {
+        // reference: the first t bins, with the clipped tail added to the last one
+        std::vector<double> p(hist.begin(), hist.begin() + t);
+        for (int i = t; i < histogramBins; i++)
+            p[t - 1] += hist[i];
+
+        // candidate: the first t bins merged into quantizedLevels groups and spread back evenly
+        // over the bins of each group that were not empty
+        std::vector<double> q(t, 0.0);
+        for (int j = 0; j < quantizedLevels; j++) {
+            const int start = j * t / quantizedLevels;
+            const int end = (j + 1) * t / quantizedLevels;
+            double sum = 0;
+            int used = 0;
+            for (int i = start; i < end; i++) {
+                sum += hist[i];
+                used += hist[i] != 0;
+            }
+            for (int i = start; i < end && used; i++) {
+                if (hist[i] != 0)
+                    q[i] = sum / used;
+            }
+        }
+
+        double pSum = 0, qSum = 0;
+        for (int i = 0; i < t; i++) {
+            pSum += p[i];
+            qSum += q[i];
+        }
+        if (pSum == 0 || qSum == 0)
+            continue;
+        double kl = 0;
+        for (int i = 0; i < t; i++) {
+            if (p[i] == 0)
+                continue;
+            const double pi = p[i] / pSum;
+            const double qi = std::max(q[i] / qSum, 1e-10);
+            kl += pi * std::log(pi / qi);
+        }
+        if (kl < bestKl) {
+            bestKl = kl;
+            best = t;
+        }
+    }
+    return best;
+}
+
+static int writeTable(const Options &opt, const std::vector<std::vector<uint8_t>> &frames, int format, int bits, int bytes) {
+    ncnn::Net net;
+    net.opt.use_vulkan_compute = false;
+    net.opt.num_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    // in lightmode create_pipeline releases weight_data, which the weight scales are read from
+    net.opt.lightmode = false;
+    if (net.load_param(opt.param.c_str()) || net.load_model(opt.bin.c_str())) {
+        fprintf(stderr, "can't load model %s\n", opt.param.c_str());
+        return 1;
+    }
+
+    std::vector<const ncnn::Convolution *> convs;
+    for (const ncnn::Layer *layer : net.layers()) {
+        if (layer->type == "Convolution")
+            convs.push_back(static_cast<const ncnn::Convolution *>(layer));
+    }
+
+    // padded tiles spread evenly over every frame, the same input the plugin feeds the net
+    const int xtiles = (opt.width + opt.tileSize - 1) / opt.tileSize;
+    const int ytiles = (opt.height + opt.tileSize - 1) / opt.tileSize;
+    const int perFrame = std::min(opt.tiles, xtiles * ytiles);
+    const int side = opt.tileSize + opt.prepadding * 2;
+    const size_t plane = static_cast<size_t>(opt.width) * bytes * opt.height;
+    auto sampleTile = [&](const std::vector<uint8_t> &frame, int i) {
+        const int tile = static_cast<int>(static_cast<int64_t>(i) * xtiles * ytiles / perFrame);
+        const int x0 = tile % xtiles * opt.tileSize - opt.prepadding;
+        const int y0 = tile / xtiles * opt.tileSize - opt.prepadding;
+        ncnn::Mat in(side, side, RGB_CHANNELS);
+        for (int c = 0; c < RGB_CHANNELS; c++) {
+            float *ptr = in.channel(c);
+            for (int y = 0; y < side; y++) {
+                const int sy = std::min(std::max(y0 + y, 0), opt.height - 1);
+                const uint8_t *row = frame.data() + plane * c + static_cast<size_t>(opt.width) * bytes * sy;
+                for (int x = 0; x < side; x++)
+                    *ptr++ = std::min(std::max(Waifu2x::load_sample(row, std::min(std::max(x0 + x, 0), opt.width - 1), format, bits), 0.f), 1.f);
+            }
+        }
+        return in;
+    };
+
+    // every convolution input, first for the largest magnitude and then for a histogram up to it
+    std::vector<float> absmax(convs.size(), 0.f);
+    std::vector<std::vector<double>> hists(convs.size(), std::vector<double>(histogramBins, 0.0));
+    for (int pass = 0; pass < 2; pass++) {
+        for (const std::vector<uint8_t> &frame : frames) {
+            for (int i = 0; i < perFrame; i++) {
+                ncnn::Extractor ex = net.create_extractor();
+                ex.set_light_mode(false);
+                ex.input("Input1", sampleTile(frame, i));
+                for (size_t k = 0; k < convs.size(); k++) {
+                    ncnn::Mat blob;
+                    if (ex.extract(net.blobs()[convs[k]->bottoms[0]].name.c_str(), blob)) {
+                        fprintf(stderr, "inference failed on %s\n", convs[k]->name.c_str());
+                        return 1;
+                    }
+                    for (int c = 0; c < blob.c; c++) {
+                        const float *ptr = blob.channel(c);
+                        for (int j = 0; j < blob.w * blob.h; j++) {
+                            const float v = std::fabs(ptr[j]);
+                            if (pass == 0)
+                                absmax[k] = std::max(absmax[k], v);
+                            else if (v != 0 && absmax[k] > 0)
+                                hists[k][std::min(static_cast<int>(v / absmax[k] * histogramBins), histogramBins - 1)] += 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // weights get a scale per output channel, inputs one per layer, as ncnn2int8 expects
+    std::ofstream table(opt.table);
+    for (const ncnn::Convolution *conv : convs) {
+        const int size = conv->weight_data_size / conv->num_output;
+        const float *weights = conv->weight_data;
+        table << conv->name << "_param_0";
+        for (int n = 0; n < conv->num_output; n++) {
+            float m = 0.f;
+            for (int j = 0; j < size; j++)
+                m = std::max(m, std::fabs(weights[n * size + j]));
+            table << ' ' << (m == 0 ? 1.f : 127.f / m);
+        }
+        table << '\n';
+    }
+    for (size_t k = 0; k < convs.size(); k++) {
+        const float threshold = (klThreshold(hists[k]) + 0.5f) * absmax[k] / histogramBins;
+        table << convs[k]->name << ' ' << (threshold == 0 ? 1.f : 127.f / threshold) << '\n';
+    }
+    if (!table) {
+        fprintf(stderr, "can't write %s\n", opt.table.c_str());
+        return 1;
+    }
+    fprintf(stderr, "%d convolutions calibrated on %d tiles\n", static_cast<int>(convs.size()), perFrame * static_cast<int>(frames.size()));
+    return 0;
+}
+
+// psnr of the int8 output against the fp32 output, both upscaled on the cpu by the plugin core
+static int compare(const Options &opt, const std::vector<std::vector<uint8_t>> &frames, int format, int bits, int bytes) {
+    const int cpuThread = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    std::unique_ptr<Waifu2x> fp32(new Waifu2x(opt.width, opt.height, opt.scale, 256, 256, -1, 1, cpuThread, 32, 0, 1, 0, opt.prepadding, 1, false,
+                                              format, bits, 0, 0, opt.param, opt.bin));
+    std::unique_ptr<Waifu2x> int8(new Waifu2x(opt.width, opt.height, opt.scale, 256, 256, -1, 1, cpuThread, 8, 0, 1, 0, opt.prepadding, 1, false,
+                                              format, bits, 0, 0, opt.int8Param, opt.int8Bin));
+
+    const ptrdiff_t srcStride = static_cast<ptrdiff_t>(opt.width) * bytes;
+    const ptrdiff_t dstStride = srcStride * opt.scale;
+    const size_t srcPlane = srcStride * opt.height;
+    const size_t dstPlane = dstStride * opt.height * opt.scale;
+    std::vector<uint8_t> ref(dstPlane * RGB_CHANNELS), out(dstPlane * RGB_CHANNELS);
+
+    auto run = [&](Waifu2x *waifu2x, const std::vector<uint8_t> &frame, std::vector<uint8_t> &dst, double &ms) {
+        const uint8_t *srcp[RGB_CHANNELS];
+        uint8_t *dstp[RGB_CHANNELS];
+        for (int plane = 0; plane < RGB_CHANNELS; plane++) {
+            srcp[plane] = frame.data() + srcPlane * plane;
+            dstp[plane] = dst.data() + dstPlane * plane;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const int err = waifu2x->process(srcp, dstp, srcStride, dstStride);
+        ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return err;
+    };
+
+    double fp32Ms = 0, int8Ms = 0, squared = 0, maxDiff = 0;
+    const int64_t samples = static_cast<int64_t>(opt.width) * opt.scale * opt.height * opt.scale * RGB_CHANNELS;
+    for (const std::vector<uint8_t> &frame : frames) {
+        if (run(fp32.get(), frame, ref, fp32Ms) != Waifu2x::ERROR_OK || run(int8.get(), frame, out, int8Ms) != Waifu2x::ERROR_OK) {
+            fprintf(stderr, "inference failed\n");
+            return 1;
+        }
+        for (size_t row = 0; row < dstPlane * RGB_CHANNELS; row += dstStride) {
+            for (int x = 0; x < opt.width * opt.scale; x++) {
+                const double d = Waifu2x::load_sample(ref.data() + row, x, format, bits) - Waifu2x::load_sample(out.data() + row, x, format, bits);
+                squared += d * d;
+                maxDiff = std::max(maxDiff, std::fabs(d));
+            }
+        }
+    }
+
+    const double mse = squared / (static_cast<double>(samples) * frames.size());
+    std::cout << "{\"model\": \"" << opt.int8Param << "\", \"frames\": " << frames.size()
+              << ", \"psnr_db\": " << (mse > 0 ? 10 * std::log10(1 / mse) : 999.0) << ", \"max_abs_diff\": " << maxDiff
+              << ", \"fp32_ms\": " << fp32Ms / frames.size() << ", \"int8_ms\": " << int8Ms / frames.size() << "}\n";
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+
+    int format, bits, bytes;
+    if (!Waifu2x::parse_format(opt.format, format, bits, bytes)) {
+        usage();
+        return 1;
+    }
+
+    const size_t frameSize = static_cast<size_t>(opt.width) * bytes * opt.height * RGB_CHANNELS;
+    std::vector<std::vector<uint8_t>> frames;
+    std::ifstream f(opt.input, std::ios::binary);
+    std::vector<uint8_t> frame(frameSize);
+    while (frames.size() < static_cast<size_t>(opt.frames) && f.read(reinterpret_cast<char *>(frame.data()), frameSize))
+        frames.push_back(frame);
+    if (frames.empty()) {
+        fprintf(stderr, "can't read a %dx%d %s frame from %s\n", opt.width, opt.height, opt.format.c_str(), opt.input.c_str());
+        return 1;
+    }
+
+    return opt.mode == "table" ? writeTable(opt, frames, format, bits, bytes) : compare(opt, frames, format, bits, bytes);
+}
@@ -24,12 +24,155 @@
 */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
 #include <vector>
+#include <sys/stat.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "waifu2x.hpp"
 
 #define DIV_CEIL(a, b) (((a) + (b) - 1) / (b))
 #define PAD_TO_ALIGN(a, b) ((((a) + (b) - 1) / (b)) * (b) - (a))
 
+// adds the time since t to acc and restarts t
+static void lap(double& acc, std::chrono::steady_clock::time_point& t) {
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    acc += std::chrono::duration<double, std::milli>(now - t).count();
+    t = now;
+}
+
+// read-only mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() : ptr(nullptr), len(0) {
+    }
+    ~MappedFile() {
+        close();
+    }
+    bool open(const std::string& path);
+    void close();
+    const uint8_t* data() const {
+        return ptr;
+    }
+    size_t size() const {
+        return len;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const uint8_t* ptr;
+    size_t len;
+};
+
+bool MappedFile::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+    // the view keeps the mapping alive
+    ptr = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+    if (!ptr)
+        return false;
+    len = static_cast<size_t>(size.QuadPart);
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    ptr = static_cast<const uint8_t*>(p);
+    len = st.st_size;
+#endif
+    return true;
+}
+
+void MappedFile::close() {
+    if (!ptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(ptr);
+#else
+    munmap(const_cast<uint8_t*>(ptr), len);
+#endif
+    ptr = nullptr;
+    len = 0;
+}
+
+// a net loaded from a pack, declared after the mapping so it goes first
+struct PackedNet {
+    MappedFile pack;
+    ncnn::Net net;
+};
+
+// loads the pack of parampath and modelpath into packed.net, false if there is no usable one,
+// including one whose contents don't match its checksum
+static bool load_pack(PackedNet& packed, const std::string& parampath, const std::string& modelpath) {
+    struct stat model_st;
+    if (stat(modelpath.c_str(), &model_st) != 0 || !packed.pack.open(Waifu2x::pack_path(parampath)))
+        return false;
+    std::ifstream pf(parampath, std::ios::binary);
+    const std::string param((std::istreambuf_iterator<char>(pf)), std::istreambuf_iterator<char>());
+
+    const uint8_t* data = packed.pack.data();
+    const size_t size = packed.pack.size();
+    Waifu2x::PackHeader header;
+    bool ok = size >= sizeof(header);
+    if (ok) {
+        memcpy(&header, data, sizeof(header));
+        ok = memcmp(header.magic, "W2XPACK", 8) == 0 && header.version == Waifu2x::PACK_VERSION &&
+             header.param_size > 0 && sizeof(header) + header.param_size <= header.model_offset &&
+             header.model_offset % Waifu2x::PACK_ALIGN == 0 && header.model_offset + header.model_size == size &&
+             header.source_param_size == param.size() && header.param_size == param.size() + 1 &&
+             header.source_model_size == static_cast<uint64_t>(model_st.st_size) &&
+             memcmp(data + sizeof(header), param.c_str(), param.size() + 1) == 0;
+    }
+    if (ok)
+        ok = Waifu2x::hash_bytes(data + sizeof(header), size - sizeof(header)) == header.checksum;
+    if (ok)
+        ok = packed.net.load_param_mem(reinterpret_cast<const char*>(data + sizeof(header))) == 0;
+    if (ok)
+        ok = static_cast<uint64_t>(packed.net.load_model(data + header.model_offset)) == header.model_size;
+    if (!ok) {
+        packed.net.clear();
+        packed.pack.close();
+    }
+    return ok;
+}
+
 static const uint32_t waifu2x_preproc_fp32_spv_data[] = {
     #include "waifu2x_preproc_fp32.spv.hex.h"
 };
@@ -56,233 +199,1401 @@ static const uint32_t waifu2x_postproc_tta_fp16_spv_data[] = {
     #include "waifu2x_postproc_tta_fp16.spv.hex.h"
 };
 
+static const uint32_t waifu2x_resize_spv_data[] = {
+    #include "waifu2x_resize.spv.hex.h"
+};
 
-Waifu2x::Waifu2x(int width, int height, int scale, int tilesizew, int tilesizeh, int gpuid, int gputhread,
-    int precision, int tta, int prepadding, const std::string& parampath, const std::string& modelpath) :
-    width(width), height(height), scale(scale), tilesizew(tilesizew), tilesizeh(tilesizeh), prepadding(prepadding), tta(tta), semaphore(gputhread)
+
+// frame over the same memory with barrier state in data. Rows write disjoint parts of a frame or
+// only read it, so they need no barriers between each other. The state starts as written by a
+// shader, the row's first use then waits for whatever used the frame before within its submit,
+// and earlier submits were waited for on the host.
+static ncnn::VkMat frame_view(const ncnn::VkMat& frame, ncnn::VkBufferMemory& data) {
+    data = *frame.data;
+    data.access_flags = VK_ACCESS_SHADER_WRITE_BIT;
+    data.stage_flags = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    data.refcount = 0;
+    return ncnn::VkMat(frame.w, frame.h, frame.c, &data, frame.elemsize, frame.allocator);
+}
+
+// splits length into the fewest tiles no larger than tilesize, all of nearly the same size, so no
+// thin leftover tile pays full padding and dispatch cost. Tiles are multiples of align, which is
+// what every tile gets padded to anyway, only the last one may be shorter.
+static std::vector<int> plan_tiles(int length, int tilesize, int align) {
+    const int n = DIV_CEIL(length, tilesize);
+    const int units = DIV_CEIL(length, align);
+    std::vector<int> bounds(n + 1);
+    for (int i = 0; i <= n; i++) {
+        bounds[i] = std::min((int)((int64_t)units * i / n) * align, length);
+    }
+    return bounds;
+}
+
+Waifu2x::Waifu2x(int width, int height, int scale, int tilesizew, int tilesizeh, int gpuid, int gputhread, int cputhread,
+    int precision, int optprofile, int tta, int batch, int prepadding, int pipelinedepth, bool stream, int format, int bits, int matrix,
+    size_t tilecachesize,
+    const std::string& parampath, const std::string& modelpath, Waifu2x* next, bool chained) :
+    width(width), height(height), scale(scale), prepadding(prepadding), tta(std::max(tta, 1)), batch(tta > 1 && batch),
+    pipelinedepth(pipelinedepth), stream(stream), transfer_queue(false), cputhread(cputhread), format(format), bits(bits), matrix(matrix),
+    waifu2x_preproc(nullptr), waifu2x_postproc(nullptr), waifu2x_resize(nullptr),
+    contexts(gputhread),
+    tile_cache(next || chained ? 0 : tilecachesize),
+    next(next), chained(chained)
 {
-    net.opt.use_vulkan_compute = true;
-    net.opt.use_fp16_packed = precision == 16;
-    net.opt.use_fp16_storage = precision == 16;
-    net.opt.use_fp16_arithmetic = false;
-    net.opt.use_int8_storage = false;
-    net.opt.use_int8_arithmetic = false;
-    net.set_vulkan_device(gpuid);
-    net.load_param(parampath.c_str());
-    net.load_model(modelpath.c_str());
-
-    std::vector<ncnn::vk_specialization_type> specializations;
-    waifu2x_preproc = new ncnn::Pipeline(net.vulkan_device());
+    tile_x = plan_tiles(width, tilesizew, 4 / scale);
+    tile_y = plan_tiles(height, tilesizeh, 4 / scale);
+
+    if (format == FORMAT_U8)
+        elemsize = 1;
+    else if (format == FORMAT_U16 || format == FORMAT_FP16)
+        elemsize = 2;
+    else
+        elemsize = 4;
+
+    // matrix follows the VapourSynth _Matrix values, 0 means the planes are RGB
+    if (matrix == 5 || matrix == 6) {
+        kr = 0.299f;
+        kb = 0.114f;
+    } else if (matrix == 9) {
+        kr = 0.2627f;
+        kb = 0.0593f;
+    } else {
+        kr = 0.2126f;
+        kb = 0.0722f;
+    }
+
+    net = acquire_net(gpuid, precision, optprofile, parampath, modelpath);
+
+    if (gpuid < 0) {
+        if (cputhread > 1)
+            cpu_workers.reset(new WorkerPool(cputhread - 1));
+        for (Context& ctx : contexts) {
+            if (next)
+                ctx.host_frame.resize((size_t)width * scale * height * scale * RGB_CHANNELS * sizeof(float));
+            pool.release(&ctx);
+        }
+        return;
+    }
+
+    // fp16 storage is dropped by ncnn on devices without support, so the shaders follow the loaded net.
+    // Frames passed between chained passes are float RGB.
+    shaders = acquire_shaders(gpuid, net->opt.use_fp16_storage, tta,
+                              chained ? FORMAT_FP32 : format, chained ? 32 : bits, chained ? 0 : matrix,
+                              next ? FORMAT_FP32 : format, next ? 32 : bits, next ? 0 : matrix, kr, kb);
+    waifu2x_preproc = shaders->preproc;
+    waifu2x_postproc = shaders->postproc;
+    waifu2x_resize = shaders->resize;
+
+    // with a dedicated transfer queue the copy engine uploads a row while the compute queue runs
+    // others. A chained pass reads its input on the device and uploads nothing.
+    const ncnn::GpuInfo& info = net->vulkan_device()->info;
+    transfer_queue = !chained && info.transfer_queue_family_index() != info.compute_queue_family_index();
+
+    for (Context& ctx : contexts) {
+        create_context(ctx);
+        pool.release(&ctx);
+    }
+}
+
+Waifu2x::~Waifu2x() {
+    for (Context& ctx : contexts) {
+        destroy_context(ctx);
+    }
+}
+
+int Waifu2x::tiles() const {
+    return ((int)tile_x.size() - 1) * ((int)tile_y.size() - 1) * (batch ? 2 : tta) + (next ? next->tiles() : 0);
+}
+
+std::shared_ptr<ncnn::Net> Waifu2x::acquire_net(int gpuid, int precision, int optprofile, const std::string& parampath, const std::string& modelpath) {
+    // instances with the same model on the same device share the loaded weights,
+    // entries expire with the last instance using them
+    typedef std::tuple<int, int, int, std::string, std::string> Key;
+    static std::mutex lock;
+    static std::map<Key, std::weak_ptr<ncnn::Net>> nets;
+
+    std::lock_guard<std::mutex> guard(lock);
+    const Key key(gpuid, precision, gpuid >= 0 ? optprofile : 0, parampath, modelpath);
+    std::shared_ptr<ncnn::Net> net = nets[key].lock();
+    if (net)
+        return net;
+
+    // the net shares ownership of the pack mapping it may reference weights in
+    std::shared_ptr<PackedNet> packed = std::make_shared<PackedNet>();
+    net = std::shared_ptr<ncnn::Net>(packed, &packed->net);
+
+    // gpuid -1 runs the same model on the cpu, tiles are spread over cputhread workers
+    // instead of letting every layer fork its own threads
+    net->opt.use_vulkan_compute = gpuid >= 0;
+    net->opt.num_threads = 1;
+    net->opt.use_fp16_packed = gpuid >= 0 && precision == 16;
+    net->opt.use_fp16_storage = gpuid >= 0 && precision == 16;
+    net->opt.use_fp16_arithmetic = gpuid >= 0 && precision == 16 && (optprofile & OPT_FP16_ARITHMETIC);
+    if (gpuid >= 0) {
+        net->opt.use_shader_pack8 = (optprofile & OPT_PACK8) != 0;
+        net->opt.use_winograd_convolution = !(optprofile & OPT_NO_WINOGRAD);
+        net->opt.use_sgemm_convolution = !(optprofile & OPT_NO_SGEMM);
+    }
+    // precision 8 takes a model quantized by ncnn2int8, ncnn runs int8 convolutions on the cpu only
+    net->opt.use_int8_inference = gpuid < 0 && precision == 8;
+    net->opt.use_int8_storage = gpuid < 0 && precision == 8;
+    net->opt.use_int8_arithmetic = false;
+    if (gpuid >= 0)
+        net->set_vulkan_device(gpuid);
+    if (!load_pack(*packed, parampath, modelpath)) {
+        net->load_param(parampath.c_str());
+        net->load_model(modelpath.c_str());
+    }
+
+    nets[key] = net;
+    return net;
+}
+
+std::shared_ptr<Waifu2x::Shaders> Waifu2x::acquire_shaders(int gpuid, bool fp16, int tta, int in_format, int in_bits, int in_matrix,
+                                                          int out_format, int out_bits, int out_matrix, float kr, float kb) {
+    // kr and kb follow from the matrix, so they are not part of the key
+    typedef std::tuple<int, bool, int, int, int, int, int, int, int> Key;
+    static std::mutex lock;
+    static std::map<Key, std::weak_ptr<Shaders>> cache;
+
+    std::lock_guard<std::mutex> guard(lock);
+    const Key key(gpuid, fp16, tta, in_format, in_bits, in_matrix, out_format, out_bits, out_matrix);
+    std::shared_ptr<Shaders> shaders = cache[key].lock();
+    if (shaders)
+        return shaders;
+
+    const ncnn::VulkanDevice* vkdev = ncnn::get_gpu_device(gpuid);
+
+    // the tta shaders take the orientation step as one more constant
+    std::vector<ncnn::vk_specialization_type> specializations(tta > 1 ? 6 : 5);
+    specializations[0].i = in_format;
+    specializations[1].i = in_bits;
+    specializations[2].i = in_matrix != 0;
+    specializations[3].f = kr;
+    specializations[4].f = kb;
+    if (tta > 1)
+        specializations[5].i = 8 / tta;
+
+    ncnn::Pipeline* waifu2x_preproc = new ncnn::Pipeline(vkdev);
     waifu2x_preproc->set_optimal_local_size_xyz(8, 8, 3);
-    if (tta) {
-        if (net.opt.use_fp16_storage)
+    if (tta > 1) {
+        if (fp16)
             waifu2x_preproc->create(waifu2x_preproc_tta_fp16_spv_data, sizeof(waifu2x_preproc_tta_fp16_spv_data), specializations);
         else
             waifu2x_preproc->create(waifu2x_preproc_tta_fp32_spv_data, sizeof(waifu2x_preproc_tta_fp32_spv_data), specializations);
     } else {
-        if (net.opt.use_fp16_storage)
+        if (fp16)
             waifu2x_preproc->create(waifu2x_preproc_fp16_spv_data, sizeof(waifu2x_preproc_fp16_spv_data), specializations);
         else
             waifu2x_preproc->create(waifu2x_preproc_fp32_spv_data, sizeof(waifu2x_preproc_fp32_spv_data), specializations);
     }
 
 
-    waifu2x_postproc = new ncnn::Pipeline(net.vulkan_device());
+    specializations[0].i = out_format;
+    specializations[1].i = out_bits;
+    specializations[2].i = out_matrix != 0;
+
+    ncnn::Pipeline* waifu2x_postproc = new ncnn::Pipeline(vkdev);
     waifu2x_postproc->set_optimal_local_size_xyz(8, 8, 3);
-    if (tta) {
-        if (net.opt.use_fp16_storage)
+    if (tta > 1) {
+        if (fp16)
             waifu2x_postproc->create(waifu2x_postproc_tta_fp16_spv_data, sizeof(waifu2x_postproc_tta_fp16_spv_data), specializations);
         else
             waifu2x_postproc->create(waifu2x_postproc_tta_fp32_spv_data, sizeof(waifu2x_postproc_tta_fp32_spv_data), specializations);
     } else {
-        if (net.opt.use_fp16_storage)
+        if (fp16)
             waifu2x_postproc->create(waifu2x_postproc_fp16_spv_data, sizeof(waifu2x_postproc_fp16_spv_data), specializations);
         else
             waifu2x_postproc->create(waifu2x_postproc_fp32_spv_data, sizeof(waifu2x_postproc_fp32_spv_data), specializations);
     }
-}
 
-Waifu2x::~Waifu2x() {
-    delete waifu2x_preproc;
-    delete waifu2x_postproc;
-}
+    // tiles outside the region of interest go from the input format straight to the output format
+    std::vector<ncnn::vk_specialization_type> resize_specializations(8);
+    resize_specializations[0].i = in_format;
+    resize_specializations[1].i = in_bits;
+    resize_specializations[2].i = in_matrix != 0;
+    resize_specializations[3].f = kr;
+    resize_specializations[4].f = kb;
+    resize_specializations[5].i = out_format;
+    resize_specializations[6].i = out_bits;
+    resize_specializations[7].i = out_matrix != 0;
 
-int Waifu2x::process(const float *srcR, const float *srcG, const float *srcB,
-                     float *dstR, float *dstG, float *dstB,
-                     const ptrdiff_t srcStride, const ptrdiff_t dstStride) const {
-    semaphore.wait();
+    ncnn::Pipeline* waifu2x_resize = new ncnn::Pipeline(vkdev);
+    waifu2x_resize->set_optimal_local_size_xyz(8, 8, 3);
+    waifu2x_resize->create(waifu2x_resize_spv_data, sizeof(waifu2x_resize_spv_data), resize_specializations);
 
-    ncnn::VkAllocator* blob_vkallocator = net.vulkan_device()->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = net.vulkan_device()->acquire_staging_allocator();
-    ncnn::Option opt = net.opt;
-    opt.blob_vkallocator = blob_vkallocator;
-    opt.workspace_vkallocator = blob_vkallocator;
-    opt.staging_vkallocator = staging_vkallocator;
+    shaders = std::make_shared<Shaders>();
+    shaders->preproc = waifu2x_preproc;
+    shaders->postproc = waifu2x_postproc;
+    shaders->resize = waifu2x_resize;
+    cache[key] = shaders;
+    return shaders;
+}
 
-    const int xtiles = DIV_CEIL(width, tilesizew);
-    const int ytiles = DIV_CEIL(height, tilesizeh);
+void Waifu2x::create_context(Context& ctx) const {
+    const int xtiles = (int)tile_x.size() - 1;
+    const int ytiles = (int)tile_y.size() - 1;
 
+    // largest padded source row and network input tile anywhere in the frame
+    int in_h = 0;
+    int tile_h = 0;
+    int out_h = 0;
     for (int yi = 0; yi < ytiles; yi++) {
-        ncnn::VkCompute cmd(net.vulkan_device());
-
-        const int tile_nopad_y0 = yi * tilesizeh;
-        const int tile_nopad_y1 = std::min(tile_nopad_y0 + tilesizeh, height);
+        const int tile_nopad_y0 = tile_y[yi];
+        const int tile_nopad_y1 = tile_y[yi + 1];
         const int tile_nopad_h = tile_nopad_y1 - tile_nopad_y0;
+        out_h = std::max(out_h, tile_nopad_h * scale);
         const int prepadding_bottom = prepadding + PAD_TO_ALIGN(tile_nopad_h, 4 / scale);
-        const int tile_pad_y0 = std::max(tile_nopad_y0 - prepadding, 0);
-        const int tile_pad_y1 = std::min(tile_nopad_y1 + prepadding_bottom, height);
-        const int tile_pad_h = tile_pad_y1 - tile_pad_y0;
+        in_h = std::max(in_h, std::min(tile_nopad_y1 + prepadding_bottom, height) - std::max(tile_nopad_y0 - prepadding, 0));
+        tile_h = std::max(tile_h, tile_nopad_h + prepadding + prepadding_bottom);
+    }
+    int tile_w = 0;
+    for (int xi = 0; xi < xtiles; xi++) {
+        const int tile_nopad_w = tile_x[xi + 1] - tile_x[xi];
+        tile_w = std::max(tile_w, tile_nopad_w + prepadding + prepadding + PAD_TO_ALIGN(tile_nopad_w, 4 / scale));
+    }
+
+    // the widest padded source window and output of a row, or of a tile when streaming
+    const int samples_per_word = 4 / (int)elemsize;
+    int in_w = 0;
+    int out_w = 0;
+    for (int xi = 0; xi < (stream ? xtiles : 1); xi++) {
+        int x0, x1;
+        unit_window(xi, stream ? xi + 1 : xtiles, x0, x1);
+        in_w = std::max(in_w, x1 - x0);
+        const int out_nopad_w = (stream ? tile_x[xi + 1] - tile_x[xi] : width) * scale;
+        out_w = std::max(out_w, DIV_CEIL(out_nopad_w, samples_per_word) * samples_per_word);
+    }
+
+    // the whole output frame for the next pass, rows then need neither download nor staging
+    ctx.frame_vkallocator = nullptr;
+    if (next) {
+        ctx.frame_vkallocator = net->vulkan_device()->acquire_blob_allocator();
+        ctx.frame.create(width * scale, height * scale, RGB_CHANNELS, 4u, ctx.frame_vkallocator);
+    }
+
+    // batched tta keeps the upright and the transposed orientations side by side in one blob each
+    const int waifu2x_times = batch ? 2 : tta;
+    const int slots = batch ? tta / 2 : 1;
+
+    ctx.rows.resize(std::min(pipelinedepth, ytiles * (stream ? xtiles : 1)));
+    for (RowContext& row : ctx.rows) {
+        row.blob_vkallocator = net->vulkan_device()->acquire_blob_allocator();
+        row.staging_vkallocator = net->vulkan_device()->acquire_staging_allocator();
+        row.cmd = new ncnn::VkCompute(net->vulkan_device());
+
+        // a row whose transfer objects can't be created uploads on the compute queue instead
+        row.upload_pool = VK_NULL_HANDLE;
+        row.upload_cmd = VK_NULL_HANDLE;
+        row.acquire_pool = VK_NULL_HANDLE;
+        row.acquire_cmd = VK_NULL_HANDLE;
+        row.upload_done = VK_NULL_HANDLE;
+        row.acquire_done = VK_NULL_HANDLE;
+        if (transfer_queue) {
+            const ncnn::GpuInfo& info = net->vulkan_device()->info;
+            VkDevice device = net->vulkan_device()->vkdevice();
+
+            VkCommandPoolCreateInfo pool_info = {};
+            pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+            VkCommandBufferAllocateInfo cmd_info = {};
+            cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            cmd_info.commandBufferCount = 1;
+            VkSemaphoreCreateInfo semaphore_info = {};
+            semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            VkFenceCreateInfo fence_info = {};
+            fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+            VkFence acquire_done = VK_NULL_HANDLE;
+            pool_info.queueFamilyIndex = info.transfer_queue_family_index();
+            bool ok = vkCreateCommandPool(device, &pool_info, 0, &row.upload_pool) == VK_SUCCESS;
+            cmd_info.commandPool = row.upload_pool;
+            ok = ok && vkAllocateCommandBuffers(device, &cmd_info, &row.upload_cmd) == VK_SUCCESS;
+            pool_info.queueFamilyIndex = info.compute_queue_family_index();
+            ok = ok && vkCreateCommandPool(device, &pool_info, 0, &row.acquire_pool) == VK_SUCCESS;
+            cmd_info.commandPool = row.acquire_pool;
+            ok = ok && vkAllocateCommandBuffers(device, &cmd_info, &row.acquire_cmd) == VK_SUCCESS;
+            ok = ok && vkCreateSemaphore(device, &semaphore_info, 0, &row.upload_done) == VK_SUCCESS;
+            ok = ok && vkCreateFence(device, &fence_info, 0, &acquire_done) == VK_SUCCESS;
+            if (ok)
+                row.acquire_done = acquire_done;
+        }
+
+        // a chained pass reads the previous pass's frame as it is
+        if (!chained) {
+            row.in.create(in_w, in_h, RGB_CHANNELS, elemsize, row.staging_vkallocator);
+            row.in_gpu.create(in_w, in_h, RGB_CHANNELS, elemsize, row.blob_vkallocator);
+        }
+
+        // transposed tta tiles swap w and h, which needs the same amount of memory
+        row.in_tile_gpu.resize(waifu2x_times);
+        for (int i = 0; i < waifu2x_times; i++) {
+            row.in_tile_gpu[i].create(tile_w * slots, tile_h, RGB_CHANNELS, net->opt.use_fp16_storage ? 2u : 4u, 1, row.blob_vkallocator);
+        }
+
+        if (!next) {
+            row.out_gpu.create(out_w, out_h, RGB_CHANNELS, elemsize, row.blob_vkallocator);
+            row.out.create(out_w, out_h, RGB_CHANNELS, elemsize, row.staging_vkallocator);
+        }
+        row.frame_in = nullptr;
+        row.frame_out = nullptr;
+        row.hashes.resize(xtiles);
+        row.cached.resize(xtiles);
+        row.outside.resize(xtiles);
+        row.yi = -1;
+        row.xi0 = 0;
+        row.xi1 = 0;
+        if (ctx.rows.size() > 1)
+            row.worker.reset(new WorkerPool(1));
+    }
+}
+
+// source columns x0 to x1 - 1 that tiles xi0 to xi1 - 1 read, with their padding
+void Waifu2x::unit_window(int xi0, int xi1, int& x0, int& x1) const {
+    const int last_w = tile_x[xi1] - tile_x[xi1 - 1];
+    x0 = std::max(tile_x[xi0] - prepadding, 0);
+    x1 = std::min(tile_x[xi1] + prepadding + PAD_TO_ALIGN(last_w, 4 / scale), width);
+}
+
+void Waifu2x::destroy_context(Context& ctx) const {
+    for (RowContext& row : ctx.rows) {
+        row.worker.reset();
+        delete row.cmd;
+
+        // destroying the pools frees their command buffers
+        VkDevice device = net->vulkan_device()->vkdevice();
+        if (row.upload_pool != VK_NULL_HANDLE)
+            vkDestroyCommandPool(device, row.upload_pool, 0);
+        if (row.acquire_pool != VK_NULL_HANDLE)
+            vkDestroyCommandPool(device, row.acquire_pool, 0);
+        if (row.upload_done != VK_NULL_HANDLE)
+            vkDestroySemaphore(device, row.upload_done, 0);
+        if (row.acquire_done != VK_NULL_HANDLE)
+            vkDestroyFence(device, row.acquire_done, 0);
+
+        row.in_row.release();
+        row.out_row.release();
+        row.frame_in_view.release();
+        row.frame_out_view.release();
+        row.in.release();
+        row.in_gpu.release();
+        row.in_tile_gpu.clear();
+        row.out_gpu.release();
+        row.out.release();
+
+        net->vulkan_device()->reclaim_blob_allocator(row.blob_vkallocator);
+        net->vulkan_device()->reclaim_staging_allocator(row.staging_vkallocator);
+    }
+    ctx.rows.clear();
+
+    ctx.frame.release();
+    if (ctx.frame_vkallocator)
+        net->vulkan_device()->reclaim_blob_allocator(ctx.frame_vkallocator);
+}
+
+int Waifu2x::process_row(RowContext& row, StageTimes* times) const {
+    ncnn::Option opt = net->opt;
+    opt.blob_vkallocator = row.blob_vkallocator;
+    opt.workspace_vkallocator = row.blob_vkallocator;
+    opt.staging_vkallocator = row.staging_vkallocator;
+
+    // the caller fills the whole row from the tile cache
+    if (std::all_of(row.cached.begin() + row.xi0, row.cached.begin() + row.xi1, [](const TileCache::Entry& e) { return !!e; })) {
+        return ERROR_OK;
+    }
+    const int ntiles = row.xi1 - row.xi0;
+    const int waifu2x_times = batch ? 2 : tta;
+
+    // a chained pass reads and writes whole frames, otherwise the buffers start at the row's window
+    int in_x0, in_x1;
+    unit_window(row.xi0, row.xi1, in_x0, in_x1);
+    if (row.frame_in)
+        in_x0 = 0;
+    const int out_x0 = row.frame_out ? 0 : tile_x[row.xi0];
+
+    // drop whatever the previous row left recorded, including after a failed submit
+    ncnn::VkCompute& cmd = *row.cmd;
+    cmd.reset();
+    std::chrono::steady_clock::time_point clock = std::chrono::steady_clock::now();
 
+    const int tile_nopad_y0 = tile_y[row.yi];
+    const int tile_nopad_y1 = tile_y[row.yi + 1];
+    const int tile_nopad_h = tile_nopad_y1 - tile_nopad_y0;
+    const int prepadding_bottom = prepadding + PAD_TO_ALIGN(tile_nopad_h, 4 / scale);
 
-        // upload
-        ncnn::Mat in(width, tile_pad_h, RGB_CHANNELS, sizeof(float));
-        for (int y = 0; y < tile_pad_h; y++) {
-            memcpy((float*)in.channel(0) + y * width, srcR + (y + tile_pad_y0) * srcStride, sizeof(float) * width);
-            memcpy((float*)in.channel(1) + y * width, srcG + (y + tile_pad_y0) * srcStride, sizeof(float) * width);
-            memcpy((float*)in.channel(2) + y * width, srcB + (y + tile_pad_y0) * srcStride, sizeof(float) * width);
+
+    // upload, the destination already has the shape of the row so record_clone keeps its memory.
+    // A chained pass reads the previous pass's whole frame, which is already on the device.
+    ncnn::VkMat in_gpu;
+    if (row.frame_in) {
+        in_gpu = *row.frame_in;
+    } else if (row.acquire_done != VK_NULL_HANDLE) {
+        in_gpu = ncnn::VkMat(row.in_row.w, row.in_row.h, RGB_CHANNELS, row.in_gpu.data, elemsize, row.blob_vkallocator);
+        if (upload_row(row) != ERROR_OK) {
+            return ERROR_UPLOAD;
         }
-        
-        ncnn::VkMat in_gpu;
-        cmd.record_clone(in, in_gpu, opt);
-        if (xtiles > 1) {
+        row.work.bytes_uploaded += (int64_t)row.in_row.w * row.in_row.h * RGB_CHANNELS * elemsize;
+    } else {
+        in_gpu = ncnn::VkMat(row.in_row.w, row.in_row.h, RGB_CHANNELS, row.in_gpu.data, elemsize, row.blob_vkallocator);
+        cmd.record_clone(row.in_row, in_gpu, opt);
+        row.work.bytes_uploaded += (int64_t)row.in_row.w * row.in_row.h * RGB_CHANNELS * elemsize;
+        if (ntiles > 1 || times) {
             if (cmd.submit_and_wait()) {
                 return ERROR_UPLOAD;
             }
             cmd.reset();
         }
+    }
+    if (times)
+        lap(times->upload, clock);
 
 
-        ncnn::VkMat out_gpu;
-        out_gpu.create(width * scale, tile_nopad_h * scale, RGB_CHANNELS, sizeof(float), blob_vkallocator);
+    // rows are padded to whole 32 bit words, which is what postproc writes at a time. Into the
+    // frame for the next pass postproc writes floats, the row offset is added to the column offset.
+    const int samples_per_word = row.frame_out ? 1 : 4 / (int)elemsize;
+    ncnn::VkMat out_gpu;
+    int out_offset = 0;
+    if (row.frame_out) {
+        out_gpu = *row.frame_out;
+        out_offset = tile_nopad_y0 * scale * out_gpu.w;
+    } else {
+        const int out_w = DIV_CEIL((tile_x[row.xi1] - out_x0) * scale, samples_per_word) * samples_per_word;
+        out_gpu = ncnn::VkMat(out_w, tile_nopad_h * scale, RGB_CHANNELS, row.out_gpu.data, elemsize, row.blob_vkallocator);
+    }
 
-        for (int xi = 0; xi < xtiles; xi++) {
-            const int tile_nopad_x0 = xi * tilesizew;
-            const int tile_nopad_x1 = std::min(tile_nopad_x0 + tilesizew, width);
-            const int tile_nopad_w = tile_nopad_x1 - tile_nopad_x0;
-            const int prepadding_right = prepadding + PAD_TO_ALIGN(tile_nopad_w, 4 / scale);
+    for (int xi = row.xi0; xi < row.xi1; xi++) {
+        if (row.cached[xi]) {
+            continue;
+        }
 
-            const int waifu2x_times = tta ? 8 : 1;
+        const int tile_nopad_x0 = tile_x[xi];
+        const int tile_nopad_x1 = tile_x[xi + 1];
+        const int tile_nopad_w = tile_nopad_x1 - tile_nopad_x0;
+        const int prepadding_right = prepadding + PAD_TO_ALIGN(tile_nopad_w, 4 / scale);
 
-            std::vector<ncnn::VkMat> in_tile_gpu(waifu2x_times);
-            if (tta) {
-                for (int i = 0; i < 4; i++) {
-                    in_tile_gpu[i].create(
-                        tile_nopad_x1 - tile_nopad_x0 + prepadding + prepadding_right,
-                        tile_nopad_y1 - tile_nopad_y0 + prepadding + prepadding_bottom,
-                        RGB_CHANNELS, net.opt.use_fp16_storage ? 2u : 4u, 1, blob_vkallocator);
-                }
-                for (int i = 0; i < 4; i++) {
-                    in_tile_gpu[4 + i].create(
-                        tile_nopad_y1 - tile_nopad_y0 + prepadding + prepadding_bottom,
-                        tile_nopad_x1 - tile_nopad_x0 + prepadding + prepadding_right,
-                        RGB_CHANNELS, net.opt.use_fp16_storage ? 2u : 4u, 1, blob_vkallocator);
+        // outside the region of interest, a bilinear upscale of the source stands in for the network
+        if (row.outside[xi]) {
+            std::vector<ncnn::VkMat> bindings(2);
+            bindings[0] = in_gpu;
+            bindings[1] = out_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(13);
+            constants[0].i = in_gpu.w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = out_gpu.w;
+            constants[4].i = tile_nopad_h * scale;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = out_offset + (tile_nopad_x0 - out_x0) * scale;
+            constants[7].i = tile_nopad_w * scale;
+            constants[8].i = tile_nopad_x0 * scale;
+            constants[9].i = tile_nopad_y0 * scale;
+            constants[10].i = in_x0;
+            constants[11].i = row.frame_in ? 0 : std::max(tile_nopad_y0 - prepadding, 0);
+            constants[12].i = scale;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = DIV_CEIL(tile_nopad_w * scale, samples_per_word);
+            dispatcher.h = tile_nopad_h * scale;
+            dispatcher.c = RGB_CHANNELS;
+
+            cmd.record_pipeline(waifu2x_resize, bindings, constants, dispatcher);
+
+            if (ntiles > 1 || times) {
+                if (cmd.submit_and_wait()) {
+                    return ERROR_SUBMIT;
                 }
-            } else {
-                in_tile_gpu[0].create(
-                    tile_nopad_x1 - tile_nopad_x0 + prepadding + prepadding_right,
-                    tile_nopad_y1 - tile_nopad_y0 + prepadding + prepadding_bottom,
-                    RGB_CHANNELS, net.opt.use_fp16_storage ? 2u : 4u, 1, blob_vkallocator);
+                cmd.reset();
             }
+            if (times)
+                lap(times->postproc, clock);
+            continue;
+        }
 
-            // preproc
-            {
-                std::vector<ncnn::VkMat> bindings(1 + waifu2x_times);
-                bindings[0] = in_gpu;
-                for (int i = 0; i < waifu2x_times; ++i) {
-                    bindings[1 + i] = in_tile_gpu[i];
-                }
+        // with batch, one network run for the upright and one for the transposed orientations,
+        // slot k of a group at input column k * tile_w. The network is fully convolutional, so
+        // each slot's output lands at k * tile_w * scale and the columns straddling two slots are
+        // never read. Orientation o is bound to blob o / (step * slots), where step = 8 / tta.
+        const int slots = batch ? tta / 2 : 1;
+        const int bound = tta > 1 ? 8 : 1;
+        const int blobs_per_binding = tta > 1 ? 8 / tta * slots : 1;
+
+        const int tile_w = tile_nopad_x1 - tile_nopad_x0 + prepadding + prepadding_right;
+        const int tile_h = tile_nopad_y1 - tile_nopad_y0 + prepadding + prepadding_bottom;
+        const size_t tile_elemsize = net->opt.use_fp16_storage ? 2u : 4u;
+
+        std::vector<ncnn::VkMat> in_tile_gpu(waifu2x_times);
+        for (int i = 0; i < waifu2x_times; i++) {
+            const bool transposed = i >= waifu2x_times / 2 && tta > 1;
+            in_tile_gpu[i] = ncnn::VkMat((transposed ? tile_h : tile_w) * slots, transposed ? tile_w : tile_h, RGB_CHANNELS,
+                                         row.in_tile_gpu[i].data, tile_elemsize, row.blob_vkallocator);
+        }
+        const ncnn::VkMat& in_tile_gpu_t = in_tile_gpu[waifu2x_times / 2];
+
+        // preproc
+        {
+            std::vector<ncnn::VkMat> bindings(1 + bound);
+            bindings[0] = in_gpu;
+            for (int i = 0; i < bound; ++i) {
+                bindings[1 + i] = in_tile_gpu[i / blobs_per_binding];
+            }
+
+            std::vector<ncnn::vk_constant_type> constants(tta > 1 ? 15 : 10);
+            constants[0].i = in_gpu.w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = tile_w;
+            constants[4].i = tile_h;
+            constants[5].i = in_tile_gpu[0].cstep;
+            constants[6].i = prepadding;
+            constants[7].i = prepadding;
+            constants[8].i = tile_nopad_x0 - in_x0;
+            constants[9].i = row.frame_in ? tile_nopad_y0 : std::min(tile_nopad_y0, prepadding);
+            if (tta > 1) {
+                constants[10].i = in_tile_gpu[0].w;
+                constants[11].i = in_tile_gpu_t.w;
+                constants[12].i = in_tile_gpu_t.cstep;
+                constants[13].i = batch ? tile_w : 0;
+                constants[14].i = batch ? tile_h : 0;
+            }
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = tile_w;
+            dispatcher.h = tile_h;
+            dispatcher.c = RGB_CHANNELS;
 
-                std::vector<ncnn::vk_constant_type> constants(10);
-                constants[0].i = in_gpu.w;
-                constants[1].i = in_gpu.h;
-                constants[2].i = in_gpu.cstep;
-                constants[3].i = in_tile_gpu[0].w;
-                constants[4].i = in_tile_gpu[0].h;
-                constants[5].i = in_tile_gpu[0].cstep;
-                constants[6].i = prepadding;
-                constants[7].i = prepadding;
-                constants[8].i = tile_nopad_x0;
-                constants[9].i = std::min(tile_nopad_y0, prepadding);
-
-                ncnn::VkMat dispatcher;
-                dispatcher.w = in_tile_gpu[0].w;
-                dispatcher.h = in_tile_gpu[0].h;
-                dispatcher.c = RGB_CHANNELS;
-
-                cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
+            cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
+        }
+
+        if (times) {
+            if (cmd.submit_and_wait()) {
+                return ERROR_SUBMIT;
             }
+            cmd.reset();
+            lap(times->preproc, clock);
+        }
 
 
-            // waifu2x
-            std::vector<ncnn::VkMat> out_tile_gpu(waifu2x_times);
+        // waifu2x
+        std::vector<ncnn::VkMat> out_tile_gpu(waifu2x_times);
 
-            for (int i = 0; i < waifu2x_times; ++i) {
-                ncnn::Extractor ex = net.create_extractor();
-                ex.set_blob_vkallocator(blob_vkallocator);
-                ex.set_workspace_vkallocator(blob_vkallocator);
-                ex.set_staging_vkallocator(staging_vkallocator);
+        for (int i = 0; i < waifu2x_times; ++i) {
+            ncnn::Extractor ex = net->create_extractor();
+            ex.set_blob_vkallocator(row.blob_vkallocator);
+            ex.set_workspace_vkallocator(row.blob_vkallocator);
+            ex.set_staging_vkallocator(row.staging_vkallocator);
 
-                ex.input("Input1", in_tile_gpu[i]);
+            ex.input("Input1", in_tile_gpu[i]);
 
-                if (ex.extract("Eltwise4", out_tile_gpu[i], cmd)) {
-                    return ERROR_EXTRACTOR;
-                }
+            if (ex.extract("Eltwise4", out_tile_gpu[i], cmd)) {
+                return ERROR_EXTRACTOR;
+            }
+        }
+        row.work.tiles += waifu2x_times;
+
+        if (times) {
+            if (cmd.submit_and_wait()) {
+                return ERROR_SUBMIT;
+            }
+            cmd.reset();
+            lap(times->inference, clock);
+        }
+
+
+        // postproc
+        {
+            std::vector<ncnn::VkMat> bindings(bound + 1);
+            for (int i = 0; i < bound; ++i) {
+                bindings[i] = out_tile_gpu[i / blobs_per_binding];
+            }
+            bindings.back() = out_gpu;
+
+            const int out_tile_w = tile_nopad_w * scale;
+            const ncnn::VkMat& out_tile_gpu_t = out_tile_gpu[waifu2x_times / 2];
+
+            std::vector<ncnn::vk_constant_type> constants(tta > 1 ? 13 : 8);
+            constants[0].i = batch ? out_tile_gpu_t.h : out_tile_gpu[0].w;
+            constants[1].i = out_tile_gpu[0].h;
+            constants[2].i = out_tile_gpu[0].cstep;
+            constants[3].i = out_gpu.w;
+            constants[4].i = tile_nopad_h * scale;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = out_offset + (tile_nopad_x0 - out_x0) * scale;
+            constants[7].i = out_tile_w;
+            if (tta > 1) {
+                constants[8].i = out_tile_gpu[0].w;
+                constants[9].i = out_tile_gpu_t.w;
+                constants[10].i = out_tile_gpu_t.cstep;
+                constants[11].i = batch ? tile_w * scale : 0;
+                constants[12].i = batch ? tile_h * scale : 0;
+            }
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = DIV_CEIL(out_tile_w, samples_per_word);
+            dispatcher.h = tile_nopad_h * scale;
+            dispatcher.c = RGB_CHANNELS;
+
+            cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+        }
+
+
+        if (ntiles > 1 || times) {
+            if (cmd.submit_and_wait()) {
+                return ERROR_SUBMIT;
+            }
+            cmd.reset();
+        }
+        if (times)
+            lap(times->postproc, clock);
+    }
+
+    // the next pass picks the frame up once every row is done
+    if (row.frame_out) {
+        if (cmd.submit_and_wait()) {
+            return ERROR_SUBMIT;
+        }
+        return ERROR_OK;
+    }
+
+    // download, into the mapped staging buffer the caller scatters from
+    ncnn::Option opt_staging = opt;
+    opt_staging.blob_vkallocator = row.staging_vkallocator;
+    row.out_row = ncnn::VkMat(out_gpu.w, out_gpu.h, RGB_CHANNELS, row.out.data, elemsize, row.staging_vkallocator);
+    cmd.record_clone(out_gpu, row.out_row, opt_staging);
+    if (cmd.submit_and_wait()) {
+        return ERROR_DOWNLOAD;
+    }
+    row.work.bytes_downloaded += (int64_t)out_gpu.w * out_gpu.h * RGB_CHANNELS * elemsize;
+    row.staging_vkallocator->invalidate(row.out.data);
+    if (times)
+        lap(times->download, clock);
+
+    return ERROR_OK;
+}
+
+// copies row.in_row from the mapped staging buffer to in_gpu on the transfer queue and hands in_gpu
+// over to the compute queue family: a release barrier after the copy, and an acquire barrier in a
+// submit of its own on the compute queue behind the upload_done semaphore. Only that submit waits
+// on the compute queue, so the rows of other threads keep running on it during the copy.
+int Waifu2x::upload_row(RowContext& row) const {
+    const ncnn::VulkanDevice* vkdev = net->vulkan_device();
+    const uint32_t transfer_family = vkdev->info.transfer_queue_family_index();
+    const uint32_t compute_family = vkdev->info.compute_queue_family_index();
+    VkDevice device = vkdev->vkdevice();
+    const VkDeviceSize size = row.in_row.total() * elemsize;
+
+    VkBufferCopy region;
+    region.srcOffset = row.in.buffer_offset();
+    region.dstOffset = row.in_gpu.buffer_offset();
+    region.size = size;
+
+    // the same barrier releases on the transfer queue and acquires on the compute queue, each
+    // side ignores the access mask of the other
+    VkBufferMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.srcQueueFamilyIndex = transfer_family;
+    barrier.dstQueueFamilyIndex = compute_family;
+    barrier.buffer = row.in_gpu.buffer();
+    barrier.offset = row.in_gpu.buffer_offset();
+    barrier.size = size;
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    if (vkResetCommandBuffer(row.upload_cmd, 0) != VK_SUCCESS || vkBeginCommandBuffer(row.upload_cmd, &begin_info) != VK_SUCCESS) {
+        return ERROR_UPLOAD;
+    }
+    vkCmdCopyBuffer(row.upload_cmd, row.in.buffer(), row.in_gpu.buffer(), 1, &region);
+    vkCmdPipelineBarrier(row.upload_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, 0, 1, &barrier, 0, 0);
+    if (vkEndCommandBuffer(row.upload_cmd) != VK_SUCCESS) {
+        return ERROR_UPLOAD;
+    }
+
+    if (vkResetCommandBuffer(row.acquire_cmd, 0) != VK_SUCCESS || vkBeginCommandBuffer(row.acquire_cmd, &begin_info) != VK_SUCCESS) {
+        return ERROR_UPLOAD;
+    }
+    vkCmdPipelineBarrier(row.acquire_cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 1, &barrier, 0, 0);
+    if (vkEndCommandBuffer(row.acquire_cmd) != VK_SUCCESS) {
+        return ERROR_UPLOAD;
+    }
+
+    VkSubmitInfo upload_submit = {};
+    upload_submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    upload_submit.commandBufferCount = 1;
+    upload_submit.pCommandBuffers = &row.upload_cmd;
+    upload_submit.signalSemaphoreCount = 1;
+    upload_submit.pSignalSemaphores = &row.upload_done;
+
+    const VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    VkSubmitInfo acquire_submit = {};
+    acquire_submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    acquire_submit.waitSemaphoreCount = 1;
+    acquire_submit.pWaitSemaphores = &row.upload_done;
+    acquire_submit.pWaitDstStageMask = &wait_stage;
+    acquire_submit.commandBufferCount = 1;
+    acquire_submit.pCommandBuffers = &row.acquire_cmd;
+
+    // queues are held only for the submit, as ncnn does, the semaphore orders the two
+    VkQueue queue = vkdev->acquire_queue(transfer_family);
+    if (!queue) {
+        return ERROR_UPLOAD;
+    }
+    VkResult ret = vkQueueSubmit(queue, 1, &upload_submit, VK_NULL_HANDLE);
+    vkdev->reclaim_queue(transfer_family, queue);
+    if (ret != VK_SUCCESS) {
+        return ERROR_UPLOAD;
+    }
+
+    queue = vkdev->acquire_queue(compute_family);
+    if (!queue) {
+        return ERROR_UPLOAD;
+    }
+    ret = vkQueueSubmit(queue, 1, &acquire_submit, row.acquire_done);
+    vkdev->reclaim_queue(compute_family, queue);
+    if (ret != VK_SUCCESS) {
+        return ERROR_UPLOAD;
+    }
+
+    ret = vkWaitForFences(device, 1, &row.acquire_done, VK_TRUE, (uint64_t)-1);
+    vkResetFences(device, 1, &row.acquire_done);
+    if (ret != VK_SUCCESS) {
+        return ERROR_UPLOAD;
+    }
+
+    // ncnn's own barrier before the first shader read makes the copy visible to its submit
+    row.in_gpu.data->access_flags = VK_ACCESS_TRANSFER_WRITE_BIT;
+    row.in_gpu.data->stage_flags = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+    return ERROR_OK;
+}
+
+int Waifu2x::process(const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                     const ptrdiff_t srcStride, const ptrdiff_t dstStride, StageTimes* times, const Region* region, Work* work) const {
+    Work done;
+    const int ret = process_pass(nullptr, src, dst, srcStride, dstStride, times, region, done);
+    if (work)
+        work->add(done);
+    return ret;
+}
+
+// frame_in is the previous pass's output on the device, src is only read without it
+int Waifu2x::process_pass(const ncnn::VkMat* frame_in, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                          const ptrdiff_t srcStride, const ptrdiff_t dstStride, StageTimes* times, const Region* region, Work& work) const {
+    // the next pass sees the region in its own, upscaled coordinates
+    Region next_region;
+    if (region) {
+        next_region.x0 = region->x0 * scale;
+        next_region.y0 = region->y0 * scale;
+        next_region.x1 = region->x1 * scale;
+        next_region.y1 = region->y1 * scale;
+    }
+
+    // the context goes back to the pool whatever happened, its buffers stay valid after a failed row.
+    // It is held until the next pass is done with the frame it produced.
+    Context* ctx = pool.acquire();
+    int ret;
+    if (net->opt.use_vulkan_compute) {
+        ret = process_gpu(*ctx, frame_in, src, dst, srcStride, dstStride, times, region, work);
+        if (ret == ERROR_OK && next)
+            ret = next->process_pass(&ctx->frame, nullptr, dst, 0, dstStride, times, region ? &next_region : nullptr, work);
+    } else if (next) {
+        // float RGB between the passes as on the gpu, so the output doesn't depend on the device
+        const ptrdiff_t stride = (ptrdiff_t)width * scale * sizeof(float);
+        uint8_t* planes[RGB_CHANNELS];
+        for (int c = 0; c < RGB_CHANNELS; c++) {
+            planes[c] = ctx->host_frame.data() + stride * height * scale * c;
+        }
+        ret = process_cpu(src, planes, srcStride, stride, times, region, work);
+        if (ret == ERROR_OK)
+            ret = next->process_pass(nullptr, planes, dst, stride, dstStride, times, region ? &next_region : nullptr, work);
+    } else {
+        ret = process_cpu(src, dst, srcStride, dstStride, times, region, work);
+    }
+    pool.release(ctx);
+    return ret;
+}
+
+int Waifu2x::process_gpu(Context& ctx, const ncnn::VkMat* frame_in, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                         const ptrdiff_t srcStride, const ptrdiff_t dstStride, StageTimes* times, const Region* region, Work& work) const {
+    // each row in flight has its own context, so that row N+1 can be copied in and
+    // row N-1 copied out on this thread while row N runs on the gpu. Streaming goes
+    // through the tiles of every row one by one the same way.
+    const int xtiles = (int)tile_x.size() - 1;
+    const int ytiles = (int)tile_y.size() - 1;
+    const int units_per_row = stream ? xtiles : 1;
+    const int units = ytiles * units_per_row;
+    const int depth = (int)ctx.rows.size();
+
+    int ret = ERROR_OK;
+    for (int u = 0; u < units + depth; u++) {
+        RowContext& row = ctx.rows[u % depth];
+
+        // retire the row that previously occupied this slot
+        if (row.ret.valid()) {
+            ret = row.ret.get();
+            if (ret != ERROR_OK) {
+                break;
             }
 
+            std::chrono::steady_clock::time_point clock = std::chrono::steady_clock::now();
+            const bool ran = std::any_of(row.cached.begin() + row.xi0, row.cached.begin() + row.xi1, [](const TileCache::Entry& e) { return !e; });
+            if (ran && !next) {
+                const ncnn::Mat out = row.out_row.mapped();
+                const int tile_nopad_y0 = tile_y[row.yi];
+                const size_t x0 = (size_t)tile_x[row.xi0] * scale * elemsize;
+                const size_t w = (size_t)(tile_x[row.xi1] - tile_x[row.xi0]) * scale * elemsize;
+                for (int c = 0; c < RGB_CHANNELS; c++) {
+                    for (int y = 0; y < out.h; y++) {
+                        memcpy(dst[c] + (tile_nopad_y0 * scale + y) * dstStride + x0, (const unsigned char *)out.channel(c) + y * out.w * elemsize, w);
+                    }
+                }
+            }
 
-            // postproc
-            {
-                std::vector<ncnn::VkMat> bindings(waifu2x_times + 1);
-                for (int i = 0; i < waifu2x_times; ++i) {
-                    bindings[i] = out_tile_gpu[i];
+            // cached tiles were skipped on the gpu, fresh ones are remembered for later frames
+            if (tile_cache.enabled()) {
+                for (int xi = row.xi0; xi < row.xi1; xi++) {
+                    if (row.cached[xi])
+                        write_tile(dst, dstStride, xi, row.yi, row.cached[xi]);
+                    else if (!row.outside[xi])
+                        tile_cache.insert(xi, row.yi, row.hashes[xi], read_tile(dst, dstStride, xi, row.yi));
                 }
-                bindings.back() = out_gpu;
-
-                std::vector<ncnn::vk_constant_type> constants(8);
-                constants[0].i = out_tile_gpu[0].w;
-                constants[1].i = out_tile_gpu[0].h;
-                constants[2].i = out_tile_gpu[0].cstep;
-                constants[3].i = out_gpu.w;
-                constants[4].i = out_gpu.h;
-                constants[5].i = out_gpu.cstep;
-                constants[6].i = tile_nopad_x0 * scale;
-                constants[7].i = std::min(out_gpu.w - tile_nopad_x0 * scale, tilesizew * scale);
-
-                ncnn::VkMat dispatcher;
-                dispatcher.w = std::min(out_gpu.w - tile_nopad_x0 * scale, tilesizew * scale);
-                dispatcher.h = out_gpu.h;
-                dispatcher.c = RGB_CHANNELS;
-
-                cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
             }
+            work.add(row.work);
+            if (times) {
+                lap(times->host_copy, clock);
+                times->add(row.times);
+            }
+        }
 
+        if (u >= units) {
+            continue;
+        }
 
-            if (xtiles > 1) {
-                if (cmd.submit_and_wait()) {
-                    return ERROR_SUBMIT;
+        const int yi = u / units_per_row;
+        const int xi0 = stream ? u % units_per_row : 0;
+        const int xi1 = stream ? xi0 + 1 : xtiles;
+        int tile_pad_x0, tile_pad_x1;
+        unit_window(xi0, xi1, tile_pad_x0, tile_pad_x1);
+        const int tile_pad_w = tile_pad_x1 - tile_pad_x0;
+
+        const int tile_nopad_y0 = tile_y[yi];
+        const int tile_nopad_y1 = tile_y[yi + 1];
+        const int tile_nopad_h = tile_nopad_y1 - tile_nopad_y0;
+        const int prepadding_bottom = prepadding + PAD_TO_ALIGN(tile_nopad_h, 4 / scale);
+        const int tile_pad_y0 = std::max(tile_nopad_y0 - prepadding, 0);
+        const int tile_pad_y1 = std::min(tile_nopad_y1 + prepadding_bottom, height);
+        const int tile_pad_h = tile_pad_y1 - tile_pad_y0;
+
+        // write the source rows straight into host visible staging memory
+        std::chrono::steady_clock::time_point clock = std::chrono::steady_clock::now();
+        row.frame_in = nullptr;
+        row.frame_out = nullptr;
+        if (frame_in) {
+            row.frame_in_view = frame_view(*frame_in, row.frame_in_data);
+            row.frame_in = &row.frame_in_view;
+        }
+        if (next) {
+            row.frame_out_view = frame_view(ctx.frame, row.frame_out_data);
+            row.frame_out = &row.frame_out_view;
+        }
+        if (!frame_in) {
+            row.in_row = ncnn::VkMat(tile_pad_w, tile_pad_h, RGB_CHANNELS, row.in.data, elemsize, row.staging_vkallocator);
+            ncnn::Mat in = row.in_row.mapped();
+            for (int c = 0; c < RGB_CHANNELS; c++) {
+                for (int y = 0; y < tile_pad_h; y++) {
+                    memcpy((unsigned char *)in.channel(c) + y * tile_pad_w * elemsize, src[c] + (y + tile_pad_y0) * srcStride + tile_pad_x0 * elemsize,
+                           tile_pad_w * elemsize);
                 }
-                cmd.reset();
             }
+            row.staging_vkallocator->flush(row.in.data);
+            row.in.data->access_flags = VK_ACCESS_HOST_WRITE_BIT;
+            row.in.data->stage_flags = VK_PIPELINE_STAGE_HOST_BIT;
         }
 
-        // download
-        {
-            ncnn::Mat out;
-            cmd.record_clone(out_gpu, out, opt);
-            if (cmd.submit_and_wait()) {
-                return ERROR_DOWNLOAD;
+        for (int xi = xi0; xi < xi1; xi++) {
+            row.outside[xi] = outside(region, xi, yi);
+            if (tile_cache.enabled() && !row.outside[xi]) {
+                row.hashes[xi] = hash_tile(src, srcStride, xi, yi);
+                row.cached[xi] = tile_cache.find(xi, yi, row.hashes[xi]);
+            } else {
+                row.cached[xi].reset();
+            }
+        }
+        if (times)
+            lap(times->host_copy, clock);
+
+        // the row's own worker takes it, without a pipeline it runs on this thread when its result is collected
+        row.yi = yi;
+        row.xi0 = xi0;
+        row.xi1 = xi1;
+        row.times = StageTimes();
+        row.work = Work();
+        StageTimes* row_times = times ? &row.times : nullptr;
+        if (row.worker)
+            row.ret = row.worker->submit([this, &row, row_times] { return process_row(row, row_times); });
+        else
+            row.ret = std::async(std::launch::deferred, &Waifu2x::process_row, this, std::ref(row), row_times);
+    }
+
+    // rows still in flight after an error must finish before the context is handed to another frame
+    for (RowContext& row : ctx.rows) {
+        if (row.ret.valid()) {
+            row.ret.get();
+        }
+    }
+
+    return ret;
+}
+
+Waifu2x::WorkerPool::WorkerPool(int threads) : stopping(false) {
+    for (int i = 0; i < threads; i++) {
+        this->threads.emplace_back(&WorkerPool::run, this);
+    }
+}
+
+Waifu2x::WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+std::future<int> Waifu2x::WorkerPool::submit(std::function<int()> job) {
+    std::packaged_task<int()> task(std::move(job));
+    std::future<int> ret = task.get_future();
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        queue.push_back(std::move(task));
+    }
+    cv.notify_one();
+    return ret;
+}
+
+void Waifu2x::WorkerPool::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+        cv.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+            return;
+        std::packaged_task<int()> task = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+Waifu2x::TileCache::Entry Waifu2x::TileCache::find(int xi, int yi, uint64_t hash) {
+    std::lock_guard<std::mutex> guard(mtx);
+    const auto it = index.find(Key(xi, yi, hash));
+    if (it == index.end())
+        return Entry();
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+void Waifu2x::TileCache::insert(int xi, int yi, uint64_t hash, const Entry& data) {
+    std::lock_guard<std::mutex> guard(mtx);
+    const Key key(xi, yi, hash);
+    if (index.count(key))
+        return;
+    lru.emplace_front(key, data);
+    index[key] = lru.begin();
+    size += data->size();
+    while (size > capacity && !lru.empty()) {
+        size -= lru.back().second->size();
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+// 64 bit hash of the padded input tile, everything the network sees for this tile
+uint64_t Waifu2x::hash_tile(const uint8_t* const src[RGB_CHANNELS], const ptrdiff_t srcStride, int xi, int yi) const {
+    const int tile_nopad_x0 = tile_x[xi];
+    const int tile_nopad_x1 = tile_x[xi + 1];
+    const int tile_nopad_y0 = tile_y[yi];
+    const int tile_nopad_y1 = tile_y[yi + 1];
+    const int x0 = std::max(tile_nopad_x0 - prepadding, 0);
+    const int x1 = std::min(tile_nopad_x1 + prepadding + PAD_TO_ALIGN(tile_nopad_x1 - tile_nopad_x0, 4 / scale), width);
+    const int y0 = std::max(tile_nopad_y0 - prepadding, 0);
+    const int y1 = std::min(tile_nopad_y1 + prepadding + PAD_TO_ALIGN(tile_nopad_y1 - tile_nopad_y0, 4 / scale), height);
+
+    uint64_t h = HASH_SEED;
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+        for (int y = y0; y < y1; y++) {
+            h = hash_bytes(src[c] + y * srcStride + x0 * elemsize, (x1 - x0) * elemsize, h);
+        }
+    }
+    return h;
+}
+
+uint64_t Waifu2x::hash_bytes(const uint8_t* data, size_t size, uint64_t h) {
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        h = (h ^ v) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    for (; size > 0; size--, data++) {
+        h = (h ^ *data) * 0xc4ceb9fe1a85ec53ull;
+    }
+    return h;
+}
+
+bool Waifu2x::parse_format(const std::string& name, int& format, int& bits, int& bytes) {
+    if (name == "u8") {
+        format = FORMAT_U8;
+        bits = 8;
+        bytes = 1;
+    } else if (name == "u10") {
+        format = FORMAT_U16;
+        bits = 10;
+        bytes = 2;
+    } else if (name == "u16") {
+        format = FORMAT_U16;
+        bits = 16;
+        bytes = 2;
+    } else if (name == "fp16") {
+        format = FORMAT_FP16;
+        bits = 16;
+        bytes = 2;
+    } else if (name == "fp32") {
+        format = FORMAT_FP32;
+        bits = 32;
+        bytes = 4;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+float Waifu2x::load_sample(const uint8_t* row, int x, int format, int bits) {
+    if (format == FORMAT_U8)
+        return row[x] / 255.f;
+    if (format == FORMAT_U16) {
+        uint16_t v;
+        memcpy(&v, row + x * 2, 2);
+        return v / (float)((1 << bits) - 1);
+    }
+    if (format == FORMAT_FP16) {
+        unsigned short v;
+        memcpy(&v, row + x * 2, 2);
+        return ncnn::float16_to_float32(v);
+    }
+    float v;
+    memcpy(&v, row + x * 4, 4);
+    return v;
+}
+
+std::string Waifu2x::pack_path(const std::string& parampath) {
+    const std::string ext = ".param";
+    if (parampath.size() >= ext.size() && parampath.compare(parampath.size() - ext.size(), ext.size(), ext) == 0)
+        return parampath.substr(0, parampath.size() - ext.size()) + ".w2xpack";
+    return parampath + ".w2xpack";
+}
+
+// copies the upscaled tile out of dst, planes one after another
+Waifu2x::TileCache::Entry Waifu2x::read_tile(const uint8_t* const dst[RGB_CHANNELS], const ptrdiff_t dstStride, int xi, int yi) const {
+    const int out_x0 = tile_x[xi] * scale;
+    const int out_y0 = tile_y[yi] * scale;
+    const size_t out_w = (size_t)((tile_x[xi + 1] - tile_x[xi]) * scale) * elemsize;
+    const int out_h = (tile_y[yi + 1] - tile_y[yi]) * scale;
+
+    std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>(out_w * out_h * RGB_CHANNELS);
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+        for (int y = 0; y < out_h; y++) {
+            memcpy(data->data() + (c * out_h + y) * out_w, dst[c] + (out_y0 + y) * dstStride + out_x0 * elemsize, out_w);
+        }
+    }
+    return data;
+}
+
+void Waifu2x::write_tile(uint8_t* const dst[RGB_CHANNELS], const ptrdiff_t dstStride, int xi, int yi, const TileCache::Entry& data) const {
+    const int out_x0 = tile_x[xi] * scale;
+    const int out_y0 = tile_y[yi] * scale;
+    const size_t out_w = (size_t)((tile_x[xi + 1] - tile_x[xi]) * scale) * elemsize;
+    const int out_h = (tile_y[yi + 1] - tile_y[yi]) * scale;
+
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+        for (int y = 0; y < out_h; y++) {
+            memcpy(dst[c] + (out_y0 + y) * dstStride + out_x0 * elemsize, data->data() + (c * out_h + y) * out_w, out_w);
+        }
+    }
+}
+
+// index of pixel (x, y) of a w x h image in its i-th tta orientation, as laid out by the tta shaders
+static inline int tta_index(int i, int x, int y, int w, int h) {
+    switch (i) {
+        case 0: return y * w + x;
+        case 1: return y * w + (w - 1 - x);
+        case 2: return (h - 1 - y) * w + (w - 1 - x);
+        case 3: return (h - 1 - y) * w + x;
+        case 4: return x * h + y;
+        case 5: return x * h + (h - 1 - y);
+        case 6: return (w - 1 - x) * h + (h - 1 - y);
+        default: return (w - 1 - x) * h + y;
+    }
+}
+
+bool Waifu2x::outside(const Region* region, int xi, int yi) const {
+    return region && (tile_x[xi + 1] <= region->x0 || tile_x[xi] >= region->x1 ||
+                      tile_y[yi + 1] <= region->y0 || tile_y[yi] >= region->y1);
+}
+
+// same bilinear upscale as the resize shader
+void Waifu2x::resize_cpu_tile(int xi, int yi, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                              const ptrdiff_t srcStride, const ptrdiff_t dstStride) const {
+    for (int y = tile_y[yi] * scale; y < tile_y[yi + 1] * scale; y++) {
+        const float sy = (y + 0.5f) / scale - 0.5f;
+        const int y0 = (int)std::floor(sy);
+        const float fy = sy - y0;
+        const int ya = std::min(std::max(y0, 0), height - 1);
+        const int yb = std::min(std::max(y0 + 1, 0), height - 1);
+        for (int x = tile_x[xi] * scale; x < tile_x[xi + 1] * scale; x++) {
+            const float sx = (x + 0.5f) / scale - 0.5f;
+            const int x0 = (int)std::floor(sx);
+            const float fx = sx - x0;
+            const int xa = std::min(std::max(x0, 0), width - 1);
+            const int xb = std::min(std::max(x0 + 1, 0), width - 1);
+
+            float tl[RGB_CHANNELS], tr[RGB_CHANNELS], bl[RGB_CHANNELS], br[RGB_CHANNELS], rgb[RGB_CHANNELS];
+            load_rgb(src, srcStride, xa, ya, tl);
+            load_rgb(src, srcStride, xb, ya, tr);
+            load_rgb(src, srcStride, xa, yb, bl);
+            load_rgb(src, srcStride, xb, yb, br);
+            for (int c = 0; c < RGB_CHANNELS; c++) {
+                const float top = tl[c] + (tr[c] - tl[c]) * fx;
+                const float bottom = bl[c] + (br[c] - bl[c]) * fx;
+                rgb[c] = std::min(std::max(top + (bottom - top) * fy, 0.f), 1.f);
+            }
+            store_rgb(dst, dstStride, x, y, rgb);
+        }
+    }
+}
+
+// same conversion as fetch() in the preproc shaders
+// a chained pass reads the previous pass's frame, which is float RGB
+void Waifu2x::load_rgb(const uint8_t* const src[RGB_CHANNELS], ptrdiff_t stride, int x, int y, float rgb[RGB_CHANNELS]) const {
+    const int in_format = chained ? FORMAT_FP32 : format;
+    const int in_matrix = chained ? 0 : matrix;
+    float s[RGB_CHANNELS];
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+        const uint8_t* row = src[c] + y * stride;
+        if (in_format == FORMAT_U8)
+            s[c] = row[x];
+        else if (in_format == FORMAT_U16)
+            s[c] = ((const uint16_t*)row)[x];
+        else if (in_format == FORMAT_FP16)
+            s[c] = ncnn::float16_to_float32(((const unsigned short*)row)[x]);
+        else
+            s[c] = ((const float*)row)[x];
+
+        if (in_format == FORMAT_U8 || in_format == FORMAT_U16) {
+            if (in_matrix == 0) {
+                s[c] /= (float)((1 << bits) - 1);
+            } else {
+                const float shift = (float)(1 << (bits - 8));
+                s[c] = c == 0 ? (s[c] - 16.f * shift) / (219.f * shift) : (s[c] - 128.f * shift) / (224.f * shift);
+            }
+        }
+    }
+
+    if (in_matrix == 0) {
+        std::copy(s, s + RGB_CHANNELS, rgb);
+        return;
+    }
+    rgb[0] = s[0] + 2.f * (1.f - kr) * s[2];
+    rgb[2] = s[0] + 2.f * (1.f - kb) * s[1];
+    rgb[1] = (s[0] - kr * rgb[0] - kb * rgb[2]) / (1.f - kr - kb);
+}
+
+// same conversion as to_plane() and store() in the postproc shaders, float RGB for a next pass
+void Waifu2x::store_rgb(uint8_t* const dst[RGB_CHANNELS], ptrdiff_t stride, int x, int y, const float rgb[RGB_CHANNELS]) const {
+    const int out_format = next ? FORMAT_FP32 : format;
+    const int out_matrix = next ? 0 : matrix;
+    float s[RGB_CHANNELS];
+    if (out_matrix == 0) {
+        std::copy(rgb, rgb + RGB_CHANNELS, s);
+    } else {
+        const float luma = kr * rgb[0] + (1.f - kr - kb) * rgb[1] + kb * rgb[2];
+        s[0] = luma;
+        s[1] = (rgb[2] - luma) / (2.f * (1.f - kb));
+        s[2] = (rgb[0] - luma) / (2.f * (1.f - kr));
+    }
+
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+        uint8_t* row = dst[c] + y * stride;
+        if (out_format == FORMAT_FP32) {
+            ((float*)row)[x] = s[c];
+        } else if (out_format == FORMAT_FP16) {
+            ((unsigned short*)row)[x] = ncnn::float32_to_float16(s[c]);
+        } else {
+            const float peak = (float)((1 << bits) - 1);
+            const float shift = (float)(1 << (bits - 8));
+            float q;
+            if (out_matrix == 0)
+                q = s[c] * peak;
+            else
+                q = c == 0 ? s[c] * 219.f * shift + 16.f * shift : s[c] * 224.f * shift + 128.f * shift;
+            q = std::min(std::max(std::round(q), 0.f), peak);
+            if (out_format == FORMAT_U8)
+                row[x] = (uint8_t)q;
+            else
+                ((uint16_t*)row)[x] = (uint16_t)q;
+        }
+    }
+}
+
+int Waifu2x::process_cpu_tile(int xi, int yi, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                              const ptrdiff_t srcStride, const ptrdiff_t dstStride, StageTimes* times) const {
+    std::chrono::steady_clock::time_point clock = std::chrono::steady_clock::now();
+
+    uint64_t hash = 0;
+    if (tile_cache.enabled()) {
+        hash = hash_tile(src, srcStride, xi, yi);
+        const TileCache::Entry cached = tile_cache.find(xi, yi, hash);
+        if (cached) {
+            write_tile(dst, dstStride, xi, yi, cached);
+            return ERROR_OK;
+        }
+    }
+
+    const int tile_nopad_x0 = tile_x[xi];
+    const int tile_nopad_x1 = tile_x[xi + 1];
+    const int tile_nopad_w = tile_nopad_x1 - tile_nopad_x0;
+    const int prepadding_right = prepadding + PAD_TO_ALIGN(tile_nopad_w, 4 / scale);
+
+    const int tile_nopad_y0 = tile_y[yi];
+    const int tile_nopad_y1 = tile_y[yi + 1];
+    const int tile_nopad_h = tile_nopad_y1 - tile_nopad_y0;
+    const int prepadding_bottom = prepadding + PAD_TO_ALIGN(tile_nopad_h, 4 / scale);
+
+    const int in_w = tile_nopad_w + prepadding + prepadding_right;
+    const int in_h = tile_nopad_h + prepadding + prepadding_bottom;
+
+    // the i-th run uses orientation i * step, so tta 2 and 4 take the first half of their runs upright
+    const int waifu2x_times = tta;
+    const int step = 8 / tta;
+
+    // preproc
+    std::vector<ncnn::Mat> in_tile(waifu2x_times);
+    for (int i = 0; i < waifu2x_times; i++) {
+        if (i * step < 4)
+            in_tile[i].create(in_w, in_h, RGB_CHANNELS);
+        else
+            in_tile[i].create(in_h, in_w, RGB_CHANNELS);
+    }
+
+    for (int y = 0; y < in_h; y++) {
+        const int sy = std::min(std::max(tile_nopad_y0 - prepadding + y, 0), height - 1);
+        for (int x = 0; x < in_w; x++) {
+            const int sx = std::min(std::max(tile_nopad_x0 - prepadding + x, 0), width - 1);
+            float rgb[RGB_CHANNELS];
+            load_rgb(src, srcStride, sx, sy, rgb);
+            for (int c = 0; c < RGB_CHANNELS; c++) {
+                const float v = std::min(std::max(rgb[c], 0.f), 1.f);
+                for (int i = 0; i < waifu2x_times; i++) {
+                    float* ptr = in_tile[i].channel(c);
+                    ptr[tta_index(i * step, x, y, in_w, in_h)] = v;
+                }
             }
+        }
+    }
+    if (times)
+        lap(times->preproc, clock);
 
-            for (int y = 0; y < out.h; y++) {
-                memcpy(dstR + tile_nopad_y0 * scale * dstStride + y * dstStride, (float *)out.channel(0) + y * out.w, out.w * sizeof(float));
-                memcpy(dstG + tile_nopad_y0 * scale * dstStride + y * dstStride, (float *)out.channel(1) + y * out.w, out.w * sizeof(float));
-                memcpy(dstB + tile_nopad_y0 * scale * dstStride + y * dstStride, (float *)out.channel(2) + y * out.w, out.w * sizeof(float));
+
+    // waifu2x
+    std::vector<ncnn::Mat> out_tile(waifu2x_times);
+
+    for (int i = 0; i < waifu2x_times; i++) {
+        ncnn::Extractor ex = net->create_extractor();
+
+        ex.input("Input1", in_tile[i]);
+
+        if (ex.extract("Eltwise4", out_tile[i])) {
+            return ERROR_EXTRACTOR;
+        }
+    }
+    if (times)
+        lap(times->inference, clock);
+
+
+    // postproc
+    const int out_w = out_tile[0].w;
+    const int out_h = out_tile[0].h;
+
+    for (int y = 0; y < tile_nopad_h * scale; y++) {
+        for (int x = 0; x < tile_nopad_w * scale; x++) {
+            float rgb[RGB_CHANNELS];
+            for (int c = 0; c < RGB_CHANNELS; c++) {
+                float v = 0.f;
+                for (int i = 0; i < waifu2x_times; i++) {
+                    const float* ptr = out_tile[i].channel(c);
+                    v += ptr[tta_index(i * step, x, y, out_w, out_h)];
+                }
+                rgb[c] = std::min(std::max(v / waifu2x_times, 0.f), 1.f);
             }
+            store_rgb(dst, dstStride, tile_nopad_x0 * scale + x, tile_nopad_y0 * scale + y, rgb);
         }
     }
+    if (times)
+        lap(times->postproc, clock);
+
+    if (tile_cache.enabled())
+        tile_cache.insert(xi, yi, hash, read_tile(dst, dstStride, xi, yi));
 
-    net.vulkan_device()->reclaim_blob_allocator(blob_vkallocator);
-    net.vulkan_device()->reclaim_staging_allocator(staging_vkallocator);
-    semaphore.signal(); // release only when successful
     return ERROR_OK;
 }
+
+int Waifu2x::process_cpu(const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                         const ptrdiff_t srcStride, const ptrdiff_t dstStride, StageTimes* times, const Region* region, Work& work) const {
+    const int xtiles = (int)tile_x.size() - 1;
+    const int ytiles = (int)tile_y.size() - 1;
+    const int ntiles = xtiles * ytiles;
+
+    // tiles are independent, every worker keeps taking the next one until all are done
+    std::atomic<int> next_tile(0);
+    std::atomic<int> ret(ERROR_OK);
+    std::atomic<int> ran(0);
+    std::mutex times_lock;
+    auto worker = [&]() {
+        StageTimes worker_times;
+        for (int i = next_tile++; i < ntiles && ret == ERROR_OK; i = next_tile++) {
+            if (outside(region, i % xtiles, i / xtiles)) {
+                resize_cpu_tile(i % xtiles, i / xtiles, src, dst, srcStride, dstStride);
+                continue;
+            }
+            int err = process_cpu_tile(i % xtiles, i / xtiles, src, dst, srcStride, dstStride, times ? &worker_times : nullptr);
+            if (err != ERROR_OK)
+                ret = err;
+            ran++;
+        }
+        if (times) {
+            std::lock_guard<std::mutex> guard(times_lock);
+            times->add(worker_times);
+        }
+        return (int)ERROR_OK;
+    };
+
+    // the instance's workers join this thread, frames sharing them each keep at least this thread busy
+    std::vector<std::future<int>> helpers;
+    for (int i = 1; i < std::min(cputhread, ntiles); i++) {
+        helpers.push_back(cpu_workers->submit(worker));
+    }
+    worker();
+    for (std::future<int>& helper : helpers) {
+        helper.get();
+    }
+    work.tiles += ran * tta;
+
+    return ret;
+}
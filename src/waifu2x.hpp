@@ -3,20 +3,144 @@
 
 #define RGB_CHANNELS 3
 
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <tuple>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 #include "net.h"
 #include "gpu.h"
 
 class Waifu2x
 {
 public:
-    Waifu2x(int width, int height, int scale, int tilesizew, int tilesizeh, int gpuid, int gputhread,
-            int precision, int tta, int prepadding, const std::string& parampath, const std::string& modelpath);
+    // next is a further pass taking over this pass's output, for width * scale x height * scale frames
+    // and created with chained set. The frame between them is 32 bit float RGB whatever format is,
+    // in device memory on the gpu. The tile cache is not used by chained passes.
+    // precision is 16 or 32, or 8 for a cpu instance (gpuid -1) given int8 models made by w2xnvk-quantize.
+    // optprofile is a combination of the OPT_ flags below. With stream, the gpu works through single
+    // tiles instead of tile rows and only moves each tile's padded window, so the buffers don't grow
+    // with the frame width. pipelinedepth then counts tiles in flight.
+    Waifu2x(int width, int height, int scale, int tilesizew, int tilesizeh, int gpuid, int gputhread, int cputhread,
+            int precision, int optprofile, int tta, int batch, int prepadding, int pipelinedepth, bool stream, int format, int bits, int matrix,
+            size_t tilecachesize,
+            const std::string& parampath, const std::string& modelpath, Waifu2x* next = nullptr, bool chained = false);
     ~Waifu2x();
 
-    int process(const float *srcR, const float *srcG, const float *srcB, float *dstR, float *dstG, float *dstB, ptrdiff_t srcStride, ptrdiff_t dstStride) const;
+    // milliseconds spent in each stage, summed over rows or tiles
+    struct StageTimes {
+        double host_copy = 0;
+        double upload = 0;
+        double preproc = 0;
+        double inference = 0;
+        double postproc = 0;
+        double download = 0;
+
+        void add(const StageTimes& other) {
+            host_copy += other.host_copy;
+            upload += other.upload;
+            preproc += other.preproc;
+            inference += other.inference;
+            postproc += other.postproc;
+            download += other.download;
+        }
+    };
+
+    // what a process() call actually did over all passes. Tiles taken from the tile cache or
+    // outside the region of interest don't count as tiles, frames kept on the device between
+    // chained passes aren't moved, and the cpu moves nothing.
+    struct Work {
+        int tiles = 0; // network evaluations, counted as in tiles()
+        int64_t bytes_uploaded = 0;
+        int64_t bytes_downloaded = 0;
+
+        void add(const Work& other) {
+            tiles += other.tiles;
+            bytes_uploaded += other.bytes_uploaded;
+            bytes_downloaded += other.bytes_downloaded;
+        }
+    };
+
+    // region of interest in source pixels, x1 and y1 exclusive
+    struct Region {
+        int x0;
+        int y0;
+        int x1;
+        int y1;
+    };
+
+    // with times set, each stage is submitted and waited for on its own so it can be timed,
+    // which makes the call slower than without. With region set, tiles not touching it skip
+    // inference and get a bilinear upscale of the source instead. work, if set, is added to.
+    int process(const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS], ptrdiff_t srcStride, ptrdiff_t dstStride,
+                StageTimes* times = nullptr, const Region* region = nullptr, Work* work = nullptr) const;
+
+    // network evaluations per frame over all passes when every tile runs, tta counts every orientation
+    // or every batched group of them
+    int tiles() const;
+
+    // sample type of the planes passed to process(), converted on the gpu
+    enum {
+        FORMAT_FP32 = 0,
+        FORMAT_U8 = 1,
+        FORMAT_U16 = 2,
+        FORMAT_FP16 = 3
+    };
+
+    // the sample formats of the command line tools: u8, u10, u16, fp16 or fp32. Sets format, bits
+    // and bytes per sample, false for an unknown name.
+    static bool parse_format(const std::string& name, int& format, int& bits, int& bytes);
+
+    // sample x of a row in format with bits significant bits, integers scaled to 0-1
+    static float load_sample(const uint8_t* row, int x, int format, int bits);
+
+    // ncnn paths away from its defaults, for the gpu only. They change the output slightly,
+    // so a profile should be checked against a precision 32 instance before it is used.
+    enum {
+        OPT_FP16_ARITHMETIC = 1, // compute in fp16 too, with precision 16
+        OPT_PACK8 = 2,           // pack8 shader layout
+        OPT_NO_WINOGRAD = 4,
+        OPT_NO_SGEMM = 8,
+        OPT_ALL = 15
+    };
+
+    // a .w2xpack file, written by w2xnvk-pack, holds the .param text and the .bin of one model and is
+    // loaded from a memory mapping in place of them when it sits next to the .param. The weights
+    // start on a page boundary so ncnn references them in the mapping instead of copying them.
+    // A pack whose .param text differs from the file next to it, made from a .bin of another
+    // size, or failing its checksum is ignored and the model files are loaded as before.
+    struct PackHeader {
+        char magic[8];              // "W2XPACK", nul terminated
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t param_size;        // .param text with its terminating nul, right after the header
+        uint64_t model_offset;      // .bin, up to the end of the file
+        uint64_t model_size;
+        uint64_t source_param_size;
+        uint64_t source_model_size;
+        uint64_t checksum;          // hash_bytes() of everything after the header
+    };
+
+    enum {
+        PACK_VERSION = 1,
+        PACK_ALIGN = 4096
+    };
+
+    // the pack looked for in place of parampath, its .param extension replaced by .w2xpack
+    static std::string pack_path(const std::string& parampath);
+
+    // 64 bit hash of size bytes, continued from h to cover several ranges.
+    // Used for tile and frame contents and pack checksums.
+    static const uint64_t HASH_SEED = 0x9e3779b97f4a7c15ull;
+    static uint64_t hash_bytes(const uint8_t* data, size_t size, uint64_t h = HASH_SEED);
 
     enum {
         ERROR_OK = 0,
@@ -27,41 +151,194 @@ public:
     };
 
 private:
+    // upscaled tiles keyed by tile position and a hash of the padded input tile, so unchanged
+    // regions of later frames skip inference. Bounded in bytes, least recently used go first.
+    class TileCache {
+    public:
+        typedef std::shared_ptr<const std::vector<uint8_t>> Entry;
+
+        explicit TileCache(size_t capacity) : capacity(capacity), size(0) {
+        }
+        bool enabled() const {
+            return capacity > 0;
+        }
+        Entry find(int xi, int yi, uint64_t hash);
+        void insert(int xi, int yi, uint64_t hash, const Entry& data);
+
+    private:
+        typedef std::tuple<int, int, uint64_t> Key;
+        typedef std::list<std::pair<Key, Entry>> List;
+
+        size_t capacity;
+        size_t size;
+        List lru;
+        std::map<Key, List::iterator> index;
+        std::mutex mtx;
+    };
+
+    // threads kept for the life of their owner, running jobs in the order they were submitted.
+    // The queue is emptied before the threads stop.
+    class WorkerPool {
+    public:
+        explicit WorkerPool(int threads);
+        ~WorkerPool();
+        std::future<int> submit(std::function<int()> job);
+
+    private:
+        void run();
+
+        std::vector<std::thread> threads;
+        std::deque<std::packaged_task<int()>> queue;
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool stopping;
+    };
+
+    bool outside(const Region* region, int xi, int yi) const;
+    uint64_t hash_tile(const uint8_t* const src[RGB_CHANNELS], ptrdiff_t srcStride, int xi, int yi) const;
+    TileCache::Entry read_tile(const uint8_t* const dst[RGB_CHANNELS], ptrdiff_t dstStride, int xi, int yi) const;
+    void write_tile(uint8_t* const dst[RGB_CHANNELS], ptrdiff_t dstStride, int xi, int yi, const TileCache::Entry& data) const;
+
+    // everything one tile row, or one tile when streaming, needs on the gpu. Allocated once at the
+    // largest size and aliased at the actual size of each row, so frames reuse the same memory.
+    struct RowContext {
+        ncnn::VkAllocator* blob_vkallocator;
+        ncnn::VkAllocator* staging_vkallocator;
+        ncnn::VkCompute* cmd;
+        // with a dedicated transfer queue, in is copied to in_gpu on it by upload_cmd, and
+        // acquire_cmd takes in_gpu over on the compute queue once upload_done is signalled
+        VkCommandPool upload_pool;
+        VkCommandBuffer upload_cmd;
+        VkCommandPool acquire_pool;
+        VkCommandBuffer acquire_cmd;
+        VkSemaphore upload_done;
+        VkFence acquire_done;
+        ncnn::VkMat in;
+        ncnn::VkMat in_gpu;
+        std::vector<ncnn::VkMat> in_tile_gpu;
+        ncnn::VkMat out_gpu;
+        ncnn::VkMat out;
+        ncnn::VkMat in_row;
+        ncnn::VkMat out_row;
+        const ncnn::VkMat* frame_in;
+        const ncnn::VkMat* frame_out;
+        // the chained frames as this row sees them, with barrier state of its own so that rows
+        // recording at the same time don't race on the flags of the shared buffer
+        ncnn::VkBufferMemory frame_in_data;
+        ncnn::VkBufferMemory frame_out_data;
+        ncnn::VkMat frame_in_view;
+        ncnn::VkMat frame_out_view;
+        StageTimes times;
+        Work work;
+        std::vector<uint64_t> hashes;
+        std::vector<TileCache::Entry> cached;
+        std::vector<uint8_t> outside;
+        int yi;
+        int xi0; // tiles xi0 to xi1 - 1 of row yi
+        int xi1;
+        std::unique_ptr<WorkerPool> worker; // one thread, with more than one row in flight
+        std::future<int> ret;
+    };
+
+    // one per gpu_thread, a frame holds it from start to end of process(). With a next pass, frame
+    // holds this pass's output until the next pass has read it, host_frame on the cpu.
+    struct Context {
+        std::vector<RowContext> rows;
+        ncnn::VkAllocator* frame_vkallocator;
+        ncnn::VkMat frame;
+        std::vector<uint8_t> host_frame;
+    };
+
+    // compiled pre/postproc and resize shaders for one combination of device, storage type, tta and sample format
+    struct Shaders {
+        ncnn::Pipeline* preproc;
+        ncnn::Pipeline* postproc;
+        ncnn::Pipeline* resize;
+        ~Shaders() {
+            delete preproc;
+            delete postproc;
+            delete resize;
+        }
+    };
+
+    static std::shared_ptr<ncnn::Net> acquire_net(int gpuid, int precision, int optprofile, const std::string& parampath, const std::string& modelpath);
+    static std::shared_ptr<Shaders> acquire_shaders(int gpuid, bool fp16, int tta, int in_format, int in_bits, int in_matrix,
+                                                    int out_format, int out_bits, int out_matrix, float kr, float kb);
+
+    void unit_window(int xi0, int xi1, int& x0, int& x1) const;
+    void create_context(Context& ctx) const;
+    void destroy_context(Context& ctx) const;
+
+    int process_pass(const ncnn::VkMat* frame_in, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                     ptrdiff_t srcStride, ptrdiff_t dstStride, StageTimes* times, const Region* region, Work& work) const;
+    int process_gpu(Context& ctx, const ncnn::VkMat* frame_in, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                    ptrdiff_t srcStride, ptrdiff_t dstStride, StageTimes* times, const Region* region, Work& work) const;
+    int process_row(RowContext& row, StageTimes* times) const;
+    int upload_row(RowContext& row) const;
+
+    int process_cpu(const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS], ptrdiff_t srcStride, ptrdiff_t dstStride,
+                    StageTimes* times, const Region* region, Work& work) const;
+    int process_cpu_tile(int xi, int yi, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                         ptrdiff_t srcStride, ptrdiff_t dstStride, StageTimes* times) const;
+    void resize_cpu_tile(int xi, int yi, const uint8_t* const src[RGB_CHANNELS], uint8_t* const dst[RGB_CHANNELS],
+                         ptrdiff_t srcStride, ptrdiff_t dstStride) const;
+    void load_rgb(const uint8_t* const src[RGB_CHANNELS], ptrdiff_t stride, int x, int y, float rgb[RGB_CHANNELS]) const;
+    void store_rgb(uint8_t* const dst[RGB_CHANNELS], ptrdiff_t stride, int x, int y, const float rgb[RGB_CHANNELS]) const;
+
     int width;
     int height;
     int scale;
-    int tilesizew;
-    int tilesizeh;
+    std::vector<int> tile_x; // tile boundaries, xtiles + 1 entries ending at width
+    std::vector<int> tile_y;
     int prepadding;
-    int tta;
+    int tta; // orientations averaged, 1 without tta
+    int batch;
+    int pipelinedepth;
+    bool stream;
+    bool transfer_queue; // rows are uploaded on the device's transfer queue family
+    int cputhread;
+    int format;
+    int bits;
+    int matrix;
+    float kr;
+    float kb;
+    size_t elemsize;
 
-    ncnn::Net net;
-    ncnn::Pipeline* waifu2x_preproc;
-    ncnn::Pipeline* waifu2x_postproc;
+    std::shared_ptr<ncnn::Net> net;
+    std::shared_ptr<Shaders> shaders;
+    const ncnn::Pipeline* waifu2x_preproc;
+    const ncnn::Pipeline* waifu2x_postproc;
+    const ncnn::Pipeline* waifu2x_resize;
 
-    class Semaphore {
+    class ContextPool {
     private:
-        int val;
+        std::vector<Context*> idle;
         std::mutex mtx;
         std::condition_variable cv;
     public:
-        explicit Semaphore(int init_value) : val(init_value) {
-        }
-        void wait() {
+        Context* acquire() {
             std::unique_lock<std::mutex> lock(mtx);
-            while (val <= 0) {
+            while (idle.empty()) {
                 cv.wait(lock);
             }
-            val--;
+            Context* ctx = idle.back();
+            idle.pop_back();
+            return ctx;
         }
-        void signal() {
+        void release(Context* ctx) {
             std::lock_guard<std::mutex> guard(mtx);
-            val++;
+            idle.push_back(ctx);
             cv.notify_one();
         }
     };
 
-    mutable Semaphore semaphore;
+    std::vector<Context> contexts;
+    mutable ContextPool pool;
+    mutable TileCache tile_cache;
+    std::unique_ptr<WorkerPool> cpu_workers; // cputhread - 1 threads helping the calling one on the cpu
+
+    std::unique_ptr<Waifu2x> next;
+    bool chained; // the input is the previous pass's frame in device memory
 };
 
 #endif